@@ -0,0 +1,201 @@
+/*
+ * Banco de pruebas del analizador sintáctico de `simplesh`
+ *
+ * Analiza cada línea de un corpus (líneas habituales y casos extremos:
+ * tuberías largas, paréntesis muy anidados, muchas redirecciones...) un
+ * número de veces y mide el coste de `parse_cmd`, `null_terminate` y
+ * `free_cmd`: nanosegundos y reservas de memoria por línea. Además calcula
+ * una suma de comprobación de la salida de `print_cmd` para cada línea y la
+ * compara con la esperada, de modo que una optimización del analizador que
+ * cambie la forma de los árboles se detecta enseguida.
+ *
+ * Uso: parser [-n ITER] [-u] CORPUS ESPERADO
+ *
+ *   -n ITER  número de veces que se analiza cada línea (2000 por defecto)
+ *   -u       reescribe ESPERADO con las sumas actuales
+ *
+ * Devuelve 1 si alguna suma no coincide o si se pierde memoria.
+ */
+
+
+#define SIMPLESH_NO_MAIN
+#include "../simplesh.c"
+
+
+// Las reservas se cuentan enlazando con `-Wl,--wrap=...`. Con -O2 gcc
+// convierte `malloc` seguido de `memset` en `calloc`, así que también se
+// cuenta.
+void* __real_malloc(size_t);
+void* __real_calloc(size_t, size_t);
+void* __real_realloc(void*, size_t);
+void __real_free(void*);
+
+static unsigned long g_mallocs = 0;
+static unsigned long g_frees = 0;
+
+void* __wrap_malloc(size_t size)
+{
+    g_mallocs++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t nmemb, size_t size)
+{
+    g_mallocs++;
+    return __real_calloc(nmemb, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+    if (ptr == NULL)
+        g_mallocs++;
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void* ptr)
+{
+    if (ptr)
+        g_frees++;
+    __real_free(ptr);
+}
+
+
+static double now_ns()
+{
+    struct timespec ts;
+
+    TRY( clock_gettime(CLOCK_MONOTONIC, &ts) );
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+// Analiza `line` (que se copia en `buf`, porque el analizador la modifica)
+// y libera el árbol. Si `sum` no es NULL, guarda en él la suma de
+// comprobación de la salida de `print_cmd`.
+static void parse_once(const char* line, char* buf, size_t len,
+        unsigned long long* sum)
+{
+    struct cmd* cmd;
+
+    memcpy(buf, line, len + 1);
+    cmd = parse_cmd(buf);
+    null_terminate(cmd);
+
+    if (sum)
+    {
+        char* out = NULL;
+        size_t outlen = 0;
+        FILE* saved = stdout;
+
+        if ((stdout = open_memstream(&out, &outlen)) == NULL)
+        {
+            perror("open_memstream");
+            exit(EXIT_FAILURE);
+        }
+        print_cmd(cmd);
+        fclose(stdout);
+        stdout = saved;
+        *sum = fnv1a64(FNV1A_INIT, out, outlen);
+        // El búfer lo reserva libc internamente, fuera del recuento
+        __real_free(out);
+    }
+
+    free_cmd(cmd);
+    free(cmd);
+}
+
+
+int main(int argc, char** argv)
+{
+    int opt, update = 0, iters = 2000, failed = 0;
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    FILE* corpus;
+    FILE* expected;
+    double total_ns = 0;
+    unsigned long total_allocs = 0;
+    int nlines = 0;
+
+    while ((opt = getopt(argc, argv, "n:uh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                iters = atoi(optarg);
+                break;
+            case 'u':
+                update = 1;
+                break;
+            default:
+                fprintf(stderr, "Uso: %s [-n ITER] [-u] CORPUS ESPERADO\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind + 2 != argc || iters < 1)
+    {
+        fprintf(stderr, "Uso: %s [-n ITER] [-u] CORPUS ESPERADO\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if ((corpus = fopen(argv[optind], "r")) == NULL ||
+            (expected = fopen(argv[optind + 1], update ? "w" : "r")) == NULL)
+    {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%-4s %-40s %10s %8s %16s\n", "#", "línea", "ns/línea", "allocs", "suma");
+    while ((len = getline(&line, &cap, corpus)) > 0)
+    {
+        unsigned long long sum, want = 0;
+        unsigned long mallocs, frees;
+        char buf[len + 1];
+        const char* status = "";
+        double start;
+
+        if (line[len - 1] == '\n')
+            line[--len] = 0;
+        nlines++;
+
+        // Forma del árbol y reservas de una sola pasada
+        mallocs = g_mallocs;
+        frees = g_frees;
+        parse_once(line, buf, len, &sum);
+        mallocs = g_mallocs - mallocs;
+        frees = g_frees - frees;
+
+        start = now_ns();
+        for (int i = 0; i < iters; i++)
+            parse_once(line, buf, len, NULL);
+        double ns = (now_ns() - start) / iters;
+
+        if (update)
+            fprintf(expected, "%016llx\n", sum);
+        else if (fscanf(expected, "%llx", &want) != 1 || want != sum)
+        {
+            status = "  DISTINTA";
+            failed = 1;
+        }
+        if (mallocs != frees)
+        {
+            status = "  FUGA";
+            failed = 1;
+        }
+
+        printf("%-4d %-40.40s %10.0f %8lu %016llx%s\n",
+                nlines, line, ns, mallocs, sum, status);
+        total_ns += ns;
+        total_allocs += mallocs;
+    }
+
+    if (nlines > 0)
+        printf("media: %.0f ns/línea, %.1f allocs/línea (%d líneas x %d iteraciones)\n",
+                total_ns / nlines, (double) total_allocs / nlines, nlines, iters);
+
+    free(line);
+    fclose(corpus);
+    fclose(expected);
+
+    return failed;
+}
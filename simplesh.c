@@ -17,24 +17,43 @@
  */
 
 
-#define _POSIX_C_SOURCE 200809L /* IEEE 1003.1-2008 (véase /usr/include/features.h) */
+#define _GNU_SOURCE             /* IEEE 1003.1-2008 y extensiones de Linux (véase /usr/include/features.h) */
 //#define NDEBUG                /* Traduce asertos y DMACROS a 'no ops' */
 
 #include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <getopt.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdio_ext.h>
 #include <stdlib.h>
+#include <signal.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <pwd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <limits.h>
 #include <libgen.h>
 #include <math.h>
+#include <time.h>
 
 
 // Biblioteca readline
@@ -90,19 +109,98 @@ static int g_dbg_level = 0;
 
 // Número máximo de argumentos de un comando
 #define MAX_ARGS 16
-#define NUM_INTERNAL_COMMANDS 5
+#define NUM_INTERNAL_COMMANDS 16
 #define BSIZE 1024
-#define MAX_PIDS 8
+#define MAX_PIDS 256
+#define MAX_PIPE_SIZE (1 << 20)
+#define AUTO_PIPES 64
+
+
+
+// Clases de caracteres del analizador léxico: delimitadores (`WHITESPACE`,
+// " \t\r\n\v" y el final de la cadena), caracteres especiales (`SYMBOLS`,
+// "<|>&;()") y comillas o `\`. Una tabla indexada por el carácter evita
+// recorrer cada conjunto con `strchr` para cada byte de la línea.
+#define CC_SPACE  (1 << 0)
+#define CC_SYMBOL (1 << 1)
+#define CC_QUOTE  (1 << 2)
+
+static const unsigned char char_class[256] = {
+    [0] = CC_SPACE,
+    [' '] = CC_SPACE, ['\t'] = CC_SPACE, ['\r'] = CC_SPACE, ['\n'] = CC_SPACE, ['\v'] = CC_SPACE,
+    ['<'] = CC_SYMBOL, ['|'] = CC_SYMBOL, ['>'] = CC_SYMBOL, ['&'] = CC_SYMBOL,
+    [';'] = CC_SYMBOL, ['('] = CC_SYMBOL, [')'] = CC_SYMBOL,
+    ['\''] = CC_QUOTE, ['"'] = CC_QUOTE, ['\\'] = CC_QUOTE,
+};
 
+#define IS_SPACE(c) (char_class[(unsigned char) (c)] & CC_SPACE)
 
+const char * internal_commands[NUM_INTERNAL_COMMANDS] = {"cwd","cd","exit","psplit","bjobs","pipesz",
+                                                             "echo","true","cat","tee","history",
+                                                             "affinity","bclass","memo","meter","timeout"};
+pid_t processes[MAX_PIDS];
+struct timespec processes_start[MAX_PIDS];
+
+// Cola de tareas en segundo plano que esperan a que quede un hueco libre en
+// `processes`. Como la línea de órdenes se libera tras ejecutarla, cada tarea
+// guarda su propia copia del árbol `cmd` y de las cadenas a las que apunta.
+struct job {
+    int id;                  // Número de la tarea en la cola
+    int prio;                // Prioridad (mayor valor, antes se ejecuta)
+    struct timespec queued;  // Instante en el que se encoló
+    struct cmd* cmd;         // Copia del árbol `cmd` a ejecutar
+    char* strings;           // Copia de las cadenas del árbol
+    struct job* next;
+};
 
-// Delimitadores
-static const char WHITESPACE[] = " \t\r\n\v";
-// Caracteres especiales
-static const char SYMBOLS[] = "<|>&;()";
+enum job_policy { JOB_FIFO = 0, JOB_PRIO = 1 };
 
-const char * internal_commands[NUM_INTERNAL_COMMANDS] = {"cwd","cd","exit","psplit","bjobs"};
-pid_t processes[MAX_PIDS];
+struct job* job_queue = NULL;
+int g_max_jobs = 0;                     // 0 hasta inicializar (nº de CPUs)
+int g_job_prio = 0;                     // Prioridad de las nuevas tareas
+int g_next_job_id = 1;
+enum job_policy g_job_policy = JOB_FIFO;
+
+// Clase de prioridad de las tareas en segundo plano (`bclass`): valor nice,
+// clase y nivel de E/S y política de planificación. Los campos a `PRIO_KEEP`
+// se heredan del shell.
+#define PRIO_KEEP INT_MIN
+
+struct prio_class {
+    int nice;
+    int ioclass;
+    int iolevel;
+    int policy;
+};
+
+struct prio_class g_bg_class = { PRIO_KEEP, PRIO_KEEP, 0, PRIO_KEEP };
+int g_bg_workers = 0;                   // También a los trabajadores de `psplit -p`
+pid_t g_shell_pid;
+sigset_t g_sigchld_mask;                // SIGCHLD se atiende con `signalfd`
+
+// Capacidad de las tuberías creadas por el shell: 0 deja la del sistema
+// (64 KiB) hasta que `pipesz` fije otra
+int g_pipe_size = 0;
+
+// Ubicación de las etapas de las tuberías y de los trabajadores de `psplit -p`
+// en la topología de CPUs (`affinity -P on`)
+int g_placement = 0;
+int g_place_next = 0;               // LLC en la que empieza la siguiente tubería
+
+// Estado de terminación de la última orden en primer plano, como `$?`
+int g_status = 0;
+
+// La última llamada a `parse_cmd` encontró un error sintáctico
+int g_parse_error = 0;
+
+// La entrada estándar es un terminal: solo entonces se usa readline
+int g_interactive = 0;
+
+// Modo banco de pruebas (`-B N`): contador de procesos creados, compartido
+// con los hijos, y no se anuncian el inicio ni el final de las tareas en
+// segundo plano
+unsigned long* g_fork_count = NULL;
+int g_bench = 0;
 /******************************************************************************
  * Funciones auxiliares
  ******************************************************************************/
@@ -132,6 +230,87 @@ void error(const char *fmt, ...)
 }
 
 
+// Imprime el mensaje de un error sintáctico y lo anota para que la línea de
+// órdenes no se ejecute
+void syntax_error(const char *fmt, ...)
+{
+    va_list arg;
+
+    g_parse_error = 1;
+    fprintf(stderr, "%s: ", __FILE__);
+    va_start(arg, fmt);
+    vfprintf(stderr, fmt, arg);
+    va_end(arg);
+}
+
+
+// Devuelve el número de argumentos de `argv` que forman las opciones
+// iniciales según `optstring` (incluido `--`). Las órdenes internas que
+// ejecutan otra orden (`affinity`, `memo`...) pasan solo esos a `getopt`,
+// que de otro modo tomaría como suyas las opciones de la orden.
+int options_end(int argc, char** argv, const char* optstring)
+{
+    int i;
+
+    for (i = 1; i < argc; i++)
+    {
+        char* arg = argv[i];
+        if (!strcmp(arg, "--"))
+            return i + 1;
+        if (arg[0] != '-' || arg[1] == 0)
+            break;
+        // La última opción de un grupo puede tomar el argumento siguiente
+        for (arg++; *arg; arg++)
+        {
+            const char* o = strchr(optstring, *arg);
+            if (o && o[1] == ':')
+            {
+                if (arg[1] == 0)
+                    i++;
+                break;
+            }
+        }
+    }
+    return i < argc ? i : argc;
+}
+
+
+// Lee un tamaño en bytes con un sufijo K, M o G opcional. Devuelve -1 si no
+// es válido.
+long long parse_size(const char* s)
+{
+    char* end;
+    long long size = strtoll(s, &end, 10);
+
+    if (end == s)
+        return -1;
+    if (*end == 'K' || *end == 'k')
+        size <<= 10, end++;
+    else if (*end == 'M' || *end == 'm')
+        size <<= 20, end++;
+    else if (*end == 'G' || *end == 'g')
+        size <<= 30, end++;
+    return *end || size < 0 ? -1 : size;
+}
+
+
+// FNV-1a de 64 bits de `len` bytes de `data`, a partir de `h` (`FNV1A_INIT`
+// para empezar)
+#define FNV1A_INIT 0xcbf29ce484222325ULL
+
+unsigned long long fnv1a64(unsigned long long h, const void* data, size_t len)
+{
+    const unsigned char* p = data;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+
 // Imprime el mensaje de error y aborta la ejecución
 void panic(const char *fmt, ...)
 {
@@ -146,6 +325,8 @@ void panic(const char *fmt, ...)
 }
 
 
+void loop_reset();
+
 // `fork()` que muestra un mensaje de error si no se puede crear el hijo
 int fork_or_panic(const char* s)
 {
@@ -154,6 +335,15 @@ int fork_or_panic(const char* s)
     pid = fork();
     if(pid == -1)
         panic("%s failed: errno %d (%s)", s, errno, strerror(errno));
+    if(pid > 0 && g_fork_count)
+        __atomic_fetch_add(g_fork_count, 1, __ATOMIC_RELAXED);
+    // El hijo no comparte el bucle de eventos del padre ni ignora SIGPIPE
+    // aunque el padre esté ejecutando una orden interna (`run_builtin`)
+    if(pid == 0)
+    {
+        loop_reset();
+        signal(SIGPIPE, SIG_DFL);
+    }
     return pid;
 }
 
@@ -178,18 +368,26 @@ int fork_or_panic(const char* s)
 // *casting* forzado de tipo. Se consigue así polimorfismo básico en C.
 
 // Valores del campo `type` de las estructuras de datos `cmd`
-enum cmd_type { EXEC=1, REDR=2, PIPE=3, LIST=4, BACK=5, SUBS=6, INV=7 };
+enum cmd_type { EXEC=1, REDR=2, PIPE=3, LIST=4, BACK=5, SUBS=6, INV=7, PSUB=8 };
 
 struct cmd { enum cmd_type type; };
 
 // Comando con sus parámetros
 struct execcmd {
     enum cmd_type type;
-    char* argv[MAX_ARGS];
+    char** argv;            // `words` o los argumentos ya expandidos
+    char* words[MAX_ARGS];
     char* eargv[MAX_ARGS];
     int argc;
+    unsigned int noglob;    // Bit `i`: `words[i]` llevaba comillas
+    struct psubcmd* psubs;  // Sustituciones de proceso entre los argumentos
 };
 
+// Tipos de redirección: a fichero, here-document (`<<`), here-string (`<<<`),
+// duplicación de descriptores (`N>&M`, `N<&M`) y cierre (`N>&-`)
+enum redr_kind { REDR_FILE = 0, REDR_HEREDOC = 1, REDR_HERESTR = 2,
+                 REDR_DUP = 3, REDR_CLOSE = 4 };
+
 // Comando con redirección
 struct redrcmd {
     enum cmd_type type;
@@ -199,6 +397,10 @@ struct redrcmd {
     int flags;
     mode_t mode;
     int fd;
+    enum redr_kind kind;    // Salvo en REDR_FILE, `file` es el delimitador del
+                            // here-document, la cadena o el descriptor origen
+    char* data;             // Contenido del *here-document*
+    int saved;              // Copia del descriptor antes de redirigirlo
 };
 
 // Comandos con tubería
@@ -227,6 +429,19 @@ struct subscmd {
     struct cmd* cmd;
 };
 
+// Sustitución de proceso `<(cmd)` o `>(cmd)`: el argumento `argi` de la orden
+// se sustituye por `/dev/fd/N`, un extremo de la tubería conectada a `cmd`
+struct psubcmd {
+    enum cmd_type type;
+    struct cmd* cmd;
+    int dir;                // '<' o '>'
+    int argi;
+    int fd;                 // Extremo de la tubería del consumidor (o -1)
+    pid_t pid;              // Proceso que ejecuta `cmd`
+    char path[32];
+    struct psubcmd* next;
+};
+
 
 /******************************************************************************
  * Funciones para construir las estructuras de datos `cmd`
@@ -245,6 +460,7 @@ struct cmd* execcmd(void)
     }
     memset(cmd, 0, sizeof(*cmd));
     cmd->type = EXEC;
+    cmd->argv = cmd->words;
 
     return (struct cmd*) cmd;
 }
@@ -344,11 +560,91 @@ struct cmd* subscmd(struct cmd* subcmd)
 }
 
 
+// Construye una estructura `cmd` de tipo `PSUB`
+struct cmd* psubcmd(struct cmd* subcmd, int dir)
+{
+    struct psubcmd* cmd;
+
+    if ((cmd = malloc(sizeof(*cmd))) == NULL)
+    {
+        perror("psubcmd: malloc");
+        exit(EXIT_FAILURE);
+    }
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->type = PSUB;
+    cmd->cmd = subcmd;
+    cmd->dir = dir;
+    cmd->fd = -1;
+    cmd->pid = -1;
+
+    return (struct cmd*) cmd;
+}
+
+
 /******************************************************************************
  * Funciones para realizar el análisis sintáctico de la línea de órdenes
  ******************************************************************************/
 
 
+// Vale 1 si el último argumento reconocido por `get_token` tenía comillas o
+// `\`: sus comodines son literales y no se expanden
+int g_token_quoted = 0;
+
+
+// `unquote` continúa un argumento en `*s` que contiene comillas o `\`:
+// quita las comillas y resuelve los escapes desplazando el texto hacia la
+// izquierda sobre la propia línea, avanza `*s` hasta el final del argumento
+// y devuelve el nuevo final del argumento compactado.
+//
+// Entre comillas simples todo es literal; entre comillas dobles `\` solo
+// escapa `"`, `\`, `$` y `` ` ``; fuera de ellas, `\` escapa cualquier
+// carácter.
+char* unquote(char** s, char const* end_of_str)
+{
+    char* r = *s;
+    char* w = *s;
+    char quote;
+
+    g_token_quoted = 1;
+    while (r < end_of_str && !(char_class[(unsigned char) *r] & (CC_SPACE | CC_SYMBOL)))
+    {
+        switch (*r)
+        {
+            case '\\':
+                if (++r < end_of_str && *r)
+                    *w++ = *r++;
+                break;
+
+            case '\'':
+            case '"':
+                quote = *r++;
+                while (r < end_of_str && *r && *r != quote)
+                {
+                    if (quote == '"' && *r == '\\' && r + 1 < end_of_str &&
+                            strchr("\"\\$`", r[1]) && r[1])
+                        r++;
+                    *w++ = *r++;
+                }
+                if (r >= end_of_str || *r != quote)
+                {
+                    syntax_error("%s: error sintáctico: falta la comilla de cierre %c\n",
+                            __func__, quote);
+                    break;
+                }
+                r++;
+                break;
+
+            default:
+                *w++ = *r++;
+                break;
+        }
+    }
+
+    *s = r;
+    return w;
+}
+
+
 // `get_token` recibe un puntero al principio de una cadena (`start_of_str`),
 // otro puntero al final de esa cadena (`end_of_str`) y, opcionalmente, dos
 // punteros para guardar el principio y el final del token, respectivamente.
@@ -359,11 +655,12 @@ int get_token(char** start_of_str, char const* end_of_str,
         char** start_of_token, char** end_of_token)
 {
     char* s;
+    char* end = NULL;
     int ret;
 
     // Salta los espacios en blanco
     s = *start_of_str;
-    while (s < end_of_str && strchr(WHITESPACE, *s))
+    while (s < end_of_str && IS_SPACE(*s))
         s++;
 
     // `start_of_token` apunta al principio del argumento (si no es NULL)
@@ -380,8 +677,33 @@ int get_token(char** start_of_str, char const* end_of_str,
         case ')':
         case ';':
         case '&':
+            s++;
+            break;
         case '<':
             s++;
+            if (*s == '&')
+            {
+                // `<&` (duplicación de un descriptor de entrada)
+                ret = 'd';
+                s++;
+            }
+            else if (*s == '(')
+            {
+                // `<(` (sustitución de proceso)
+                ret = 'P';
+                s++;
+            }
+            else if (*s == '<')
+            {
+                // `<<` (here-document) o `<<<` (here-string)
+                ret = 'H';
+                s++;
+                if (*s == '<')
+                {
+                    ret = 'S';
+                    s++;
+                }
+            }
             break;
         case '>':
             s++;
@@ -390,6 +712,18 @@ int get_token(char** start_of_str, char const* end_of_str,
                 ret = '+';
                 s++;
             }
+            else if (*s == '&')
+            {
+                // `>&` (duplicación de un descriptor de salida)
+                ret = 'D';
+                s++;
+            }
+            else if (*s == '(')
+            {
+                // `>(` (sustitución de proceso)
+                ret = 'Q';
+                s++;
+            }
             break;
 
         default:
@@ -409,19 +743,33 @@ int get_token(char** start_of_str, char const* end_of_str,
             //            start_o|f_token                       end_o|f_token
 
             ret = 'a';
+            g_token_quoted = 0;
+            char* start_of_arg = s;
             while (s < end_of_str &&
-                    !strchr(WHITESPACE, *s) &&
-                    !strchr(SYMBOLS, *s))
+                    !(char_class[(unsigned char) *s] & (CC_SPACE | CC_SYMBOL | CC_QUOTE)))
                 s++;
+
+            // Con comillas o `\` el argumento se compacta sobre sí mismo
+            if (s < end_of_str && (char_class[(unsigned char) *s] & CC_QUOTE))
+            {
+                end = unquote(&s, end_of_str);
+                break;
+            }
+
+            // Un número pegado a `<` o `>` es el descriptor que se redirige
+            // (`2>`, `3<`...) y `get_token` devuelve `'n'`
+            if (s < end_of_str && (*s == '<' || *s == '>') && s[1] != '(' &&
+                    strspn(start_of_arg, "0123456789") == (size_t) (s - start_of_arg))
+                ret = 'n';
             break;
     }
 
     // `end_of_token` apunta al final del argumento (si no es `NULL`)
     if (end_of_token)
-        *end_of_token = s;
+        *end_of_token = end ? end : s;
 
     // Salta los espacios en blanco
-    while (s < end_of_str && strchr(WHITESPACE, *s))
+    while (s < end_of_str && IS_SPACE(*s))
         s++;
 
     // Actualiza `start_of_str`
@@ -436,17 +784,17 @@ int get_token(char** start_of_str, char const* end_of_str,
 // (`delimiter`).
 //
 // El primer puntero pasado como parámero (`start_of_str`) avanza hasta el
-// primer carácter que no está en el conjunto de caracteres `WHITESPACE`.
+// primer carácter que no es un delimitador (clase `CC_SPACE`).
 //
 // `peek` devuelve un valor distinto de `NULL` si encuentra alguno de los
-// caracteres en `delimiter` justo después de los caracteres en `WHITESPACE`.
+// caracteres en `delimiter` justo después de los delimitadores.
 
 int peek(char** start_of_str, char const* end_of_str, char* delimiter)
 {
     char* s;
 
     s = *start_of_str;
-    while (s < end_of_str && strchr(WHITESPACE, *s))
+    while (s < end_of_str && IS_SPACE(*s))
         s++;
     *start_of_str = s;
 
@@ -459,6 +807,7 @@ struct cmd* parse_line(char**, char*);
 struct cmd* parse_pipe(char**, char*);
 struct cmd* parse_exec(char**, char*);
 struct cmd* parse_subs(char**, char*);
+struct cmd* parse_psub(char**, char*);
 struct cmd* parse_redr(struct cmd*, char**, char*);
 struct cmd* null_terminate(struct cmd*);
 
@@ -476,13 +825,14 @@ struct cmd* parse_cmd(char* start_of_str)
     DPRINTF(DBG_TRACE, "STR\n");
 
     end_of_str = start_of_str + strlen(start_of_str);
+    g_parse_error = 0;
 
     cmd = parse_line(&start_of_str, end_of_str);
 
     // Comprueba que se ha alcanzado el final de la línea de órdenes
     peek(&start_of_str, end_of_str, "");
     if (start_of_str != end_of_str)
-        error("%s: error sintáctico: %s\n", __func__);
+        syntax_error("%s: error sintáctico: %s\n", __func__, start_of_str);
 
     DPRINTF(DBG_TRACE, "END\n");
 
@@ -519,7 +869,7 @@ struct cmd* parse_line(char** start_of_str, char* end_of_str)
     if (peek(start_of_str, end_of_str, ";"))
     {
         if (cmd->type == EXEC && ((struct execcmd*) cmd)->argv[0] == 0)
-            error("%s: error sintáctico: no se encontró comando\n", __func__);
+            syntax_error("%s: error sintáctico: no se encontró comando\n", __func__);
 
         // Consume el delimitador de lista de órdenes
         delimiter = get_token(start_of_str, end_of_str, 0, 0);
@@ -549,7 +899,7 @@ struct cmd* parse_pipe(char** start_of_str, char* end_of_str)
     if (peek(start_of_str, end_of_str, "|"))
     {
         if (cmd->type == EXEC && ((struct execcmd*) cmd)->argv[0] == 0)
-            error("%s: error sintáctico: no se encontró comando\n", __func__);
+            syntax_error("%s: error sintáctico: no se encontró comando\n", __func__);
 
         // Consume el delimitador de tubería
         delimiter = get_token(start_of_str, end_of_str, 0, 0);
@@ -591,8 +941,26 @@ struct cmd* parse_exec(char** start_of_str, char* end_of_str)
 
     // Bucle para separar los argumentos de las posibles redirecciones
     argc = 0;
+    struct psubcmd** last_psub = &cmd->psubs;
     while (!peek(start_of_str, end_of_str, "|)&;"))
     {
+        // ¿Sustitución de proceso? El argumento será su ruta `/dev/fd/N`
+        if (peek(start_of_str, end_of_str, "<>"))
+        {
+            struct psubcmd* psub = (struct psubcmd*) parse_psub(start_of_str, end_of_str);
+            psub->argi = argc;
+            *last_psub = psub;
+            last_psub = &psub->next;
+
+            cmd->argv[argc] = psub->path;
+            cmd->eargv[argc] = psub->path;
+            cmd->argc = ++argc;
+            if (argc >= MAX_ARGS)
+                panic("%s: demasiados argumentos\n", __func__);
+            ret = parse_redr(ret, start_of_str, end_of_str);
+            continue;
+        }
+
         if ((token = get_token(start_of_str, end_of_str,
                         &start_of_token, &end_of_token)) == 0)
             break;
@@ -600,12 +968,17 @@ struct cmd* parse_exec(char** start_of_str, char* end_of_str)
         // El siguiente token debe ser un argumento porque el bucle
         // para en los delimitadores
         if (token != 'a')
-            error("%s: error sintáctico: se esperaba un argumento\n", __func__);
+        {
+            syntax_error("%s: error sintáctico: se esperaba un argumento\n", __func__);
+            break;
+        }
 
         // Almacena el siguiente argumento reconocido. El primero es
         // el comando
         cmd->argv[argc] = start_of_token;
         cmd->eargv[argc] = end_of_token;
+        if (g_token_quoted)
+            cmd->noglob |= 1u << argc;
         cmd->argc = ++argc;
         if (argc >= MAX_ARGS)
             panic("%s: demasiados argumentos\n", __func__);
@@ -635,7 +1008,7 @@ struct cmd* parse_subs(char** start_of_str, char* end_of_str)
 
     // Consume el paréntesis de apertura
     if (!peek(start_of_str, end_of_str, "("))
-        error("%s: error sintáctico: se esperaba '('", __func__);
+        syntax_error("%s: error sintáctico: se esperaba '('\n", __func__);
     delimiter = get_token(start_of_str, end_of_str, 0, 0);
     assert(delimiter == '(');
 
@@ -647,7 +1020,10 @@ struct cmd* parse_subs(char** start_of_str, char* end_of_str)
 
     // Consume el paréntesis de cierre
     if (!peek(start_of_str, end_of_str, ")"))
-        error("%s: error sintáctico: se esperaba ')'", __func__);
+    {
+        syntax_error("%s: error sintáctico: se esperaba ')'\n", __func__);
+        return cmd;
+    }
     delimiter = get_token(start_of_str, end_of_str, 0, 0);
     assert(delimiter == ')');
 
@@ -658,40 +1034,128 @@ struct cmd* parse_subs(char** start_of_str, char* end_of_str)
 }
 
 
+// `peek_redr` devuelve un valor distinto de 0 si lo siguiente en la cadena es
+// una redirección, con o sin número de descriptor delante.
+
+int peek_redr(char** start_of_str, char const* end_of_str)
+{
+    char* s;
+
+    // `<(` y `>(` son sustituciones de proceso, no redirecciones
+    if (peek(start_of_str, end_of_str, "<>"))
+        return (*start_of_str)[1] != '(';
+
+    s = *start_of_str;
+    while (s < end_of_str && *s >= '0' && *s <= '9')
+        s++;
+    return s != *start_of_str && s < end_of_str && (*s == '<' || *s == '>') &&
+        s[1] != '(';
+}
+
+
+// `parse_psub` realiza el análisis sintáctico de una sustitución de proceso
+// `<(...)` o `>(...)` llamando a `parse_line`.
+
+struct cmd* parse_psub(char** start_of_str, char* end_of_str)
+{
+    int delimiter;
+    struct cmd* cmd;
+
+    // Consume `<(` o `>(`
+    delimiter = get_token(start_of_str, end_of_str, 0, 0);
+    assert(delimiter == 'P' || delimiter == 'Q');
+
+    // Realiza el análisis sintáctico hasta el paréntesis de cierre
+    cmd = psubcmd(parse_line(start_of_str, end_of_str), delimiter == 'P' ? '<' : '>');
+
+    // Consume el paréntesis de cierre
+    if (!peek(start_of_str, end_of_str, ")"))
+    {
+        syntax_error("%s: error sintáctico: se esperaba ')'\n", __func__);
+        return cmd;
+    }
+    delimiter = get_token(start_of_str, end_of_str, 0, 0);
+    assert(delimiter == ')');
+
+    return cmd;
+}
+
+
 // `parse_redr` realiza el análisis sintáctico de órdenes con
 // redirecciones si encuentra alguno de los delimitadores de
-// redirección ('<' o '>').
+// redirección ('<' o '>'), precedidos opcionalmente por el número del
+// descriptor a redirigir.
 
 struct cmd* parse_redr(struct cmd* cmd, char** start_of_str, char* end_of_str)
 {
-    int delimiter;
+    int delimiter, fd;
     char* start_of_token;
     char* end_of_token;
 
     // Si lo siguiente que hay a continuación es delimitador de
     // redirección...
-    while (peek(start_of_str, end_of_str, "<>"))
+    while (peek_redr(start_of_str, end_of_str))
     {
+        // ¿Número de descriptor?
+        fd = -1;
+        if (!peek(start_of_str, end_of_str, "<>"))
+        {
+            delimiter = get_token(start_of_str, end_of_str, &start_of_token, &end_of_token);
+            assert(delimiter == 'n');
+            fd = (int) strtol(start_of_token, NULL, 10);
+        }
+
         // Consume el delimitador de redirección
         delimiter = get_token(start_of_str, end_of_str, 0, 0);
-        assert(delimiter == '<' || delimiter == '>' || delimiter == '+');
+        assert(delimiter == '<' || delimiter == '>' || delimiter == '+' ||
+               delimiter == 'H' || delimiter == 'S' ||
+               delimiter == 'd' || delimiter == 'D');
 
         // El siguiente token tiene que ser el nombre del fichero de la
-        // redirección entre `start_of_token` y `end_of_token`.
+        // redirección entre `start_of_token` y `end_of_token` (o el
+        // delimitador del here-document, la cadena del here-string o el
+        // descriptor que se duplica).
         if ('a' != get_token(start_of_str, end_of_str, &start_of_token, &end_of_token))
-            error("%s: error sintáctico: se esperaba un fichero", __func__);
+        {
+            syntax_error("%s: error sintáctico: se esperaba un fichero\n", __func__);
+            return cmd;
+        }
+
+        // Descriptor por defecto según el sentido de la redirección
+        if (fd < 0)
+            fd = (delimiter == '<' || delimiter == 'H' || delimiter == 'S' ||
+                  delimiter == 'd') ? STDIN_FILENO : STDOUT_FILENO;
 
         // Construye el `cmd` para la redirección
         switch(delimiter)
         {
             case '<':
-                cmd = redrcmd(cmd, start_of_token, end_of_token, O_RDONLY, S_IRWXU, STDIN_FILENO);
+                cmd = redrcmd(cmd, start_of_token, end_of_token, O_RDONLY, S_IRWXU, fd);
                 break;
             case '>':
-                cmd = redrcmd(cmd, start_of_token, end_of_token, O_WRONLY|O_CREAT|O_TRUNC, S_IRWXU, STDOUT_FILENO);
+                cmd = redrcmd(cmd, start_of_token, end_of_token, O_WRONLY|O_CREAT|O_TRUNC, S_IRWXU, fd);
                 break;
             case '+': // >>
-                cmd = redrcmd(cmd, start_of_token, end_of_token, O_WRONLY|O_CREAT|O_APPEND, S_IRWXU, STDOUT_FILENO);
+                cmd = redrcmd(cmd, start_of_token, end_of_token, O_WRONLY|O_CREAT|O_APPEND, S_IRWXU, fd);
+                break;
+            case 'H': // <<
+                cmd = redrcmd(cmd, start_of_token, end_of_token, O_RDONLY, 0, fd);
+                ((struct redrcmd*) cmd)->kind = REDR_HEREDOC;
+                break;
+            case 'S': // <<<
+                cmd = redrcmd(cmd, start_of_token, end_of_token, O_RDONLY, 0, fd);
+                ((struct redrcmd*) cmd)->kind = REDR_HERESTR;
+                break;
+            case 'd': // N<&M
+            case 'D': // N>&M
+                cmd = redrcmd(cmd, start_of_token, end_of_token, 0, 0, fd);
+                if (end_of_token - start_of_token == 1 && *start_of_token == '-')
+                    ((struct redrcmd*) cmd)->kind = REDR_CLOSE;
+                else if (strspn(start_of_token, "0123456789") ==
+                         (size_t) (end_of_token - start_of_token))
+                    ((struct redrcmd*) cmd)->kind = REDR_DUP;
+                else
+                    syntax_error("%s: error sintáctico: se esperaba un descriptor\n", __func__);
                 break;
         }
     }
@@ -720,6 +1184,8 @@ struct cmd* null_terminate(struct cmd* cmd)
             ecmd = (struct execcmd*) cmd;
             for(i = 0; ecmd->argv[i]; i++)
                 *ecmd->eargv[i] = 0;
+            for(struct psubcmd* psub = ecmd->psubs; psub; psub = psub->next)
+                null_terminate(psub->cmd);
             break;
 
         case REDR:
@@ -760,835 +1226,6890 @@ struct cmd* null_terminate(struct cmd* cmd)
 
 
 /******************************************************************************
- * Funciones para la ejecución de la línea de órdenes
+ * Expansión de nombres de fichero (*globbing*)
  ******************************************************************************/
-void run_cwd();
-void run_exit();
-void run_cd(struct execcmd *);
-void run_psplit(struct execcmd *);
-void run_bjobs(struct execcmd *);
-void insert_process(pid_t pid);
 
-int is_internal(char * command)
+
+// Los argumentos con `*`, `?` o `[` se sustituyen por los nombres de fichero
+// que encajan con ellos, en orden alfabético; si no encaja ninguno, el
+// argumento se queda tal cual (como en bash sin `nullglob`). El resultado no
+// está limitado por `MAX_ARGS`.
+//
+// Los directorios se leen con `getdents64` en bloques grandes y su listado
+// (ya ordenado) se guarda en una caché indexada por dispositivo e i-nodo y
+// validada con la fecha de modificación del directorio, de modo que varios
+// patrones sobre el mismo directorio (p. ej. en un bucle de un guion) no
+// vuelven a leerlo. Un listado cuyo directorio se modificó en el último
+// segundo no se reutiliza: otro cambio en el mismo instante no alteraría
+// `st_mtim`.
+
+#define GLOB_CACHE_DIRS 32
+#define GLOB_DENTS_SIZE (1 << 20)
+
+struct dircache {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    time_t scanned;         // Momento de la lectura
+    int count;
+    char** names;           // Cada nombre va precedido de su `d_type`
+    char* data;
+    struct dircache* next;
+};
+
+struct dircache* g_dircache = NULL;
+int g_dircache_count = 0;
+
+struct argvec {
+    char** v;
+    int n, cap;
+};
+
+
+int has_glob(const char* s)
 {
-    for (int i = 0; i < NUM_INTERNAL_COMMANDS; i++)
+    return strpbrk(s, "*?[") != NULL;
+}
+
+
+// Añade a `vec` una copia de `s`
+void argvec_push(struct argvec* vec, const char* s)
+{
+    if (vec->n + 1 >= vec->cap)
     {
-        if(command != NULL && !strcmp(command,internal_commands[i]))
-            return 1;
+        vec->cap = vec->cap ? vec->cap * 2 : 64;
+        if ((vec->v = realloc(vec->v, vec->cap * sizeof(char*))) == NULL)
+        {
+            perror("argvec_push: realloc");
+            exit(EXIT_FAILURE);
+        }
     }
-    return 0;
+    if ((vec->v[vec->n++] = strdup(s)) == NULL)
+    {
+        perror("argvec_push: strdup");
+        exit(EXIT_FAILURE);
+    }
+    vec->v[vec->n] = NULL;
 }
 
 
-void run_internal_exec(struct execcmd * cmd)
+int cmp_names(const void* a, const void* b)
 {
-	 char * command = cmd->argv[0];
-    if(!strcmp(command,"cwd")){
-        run_cwd();
-    } else if(!strcmp(command,"exit")) {
-		  run_exit(cmd);    
-    } else if(!strcmp(command,"cd")) {
-		  run_cd(cmd);    
-    }else if(!strcmp(command,"psplit")){
-        run_psplit(cmd);
-    }else if(!strcmp(command,"bjobs")){
-        run_bjobs(cmd);
-    }
+    return strcmp(*(char* const*) a + 1, *(char* const*) b + 1);
 }
 
-void exec_cmd(struct execcmd* ecmd)
+
+void free_dircache(struct dircache* dc)
 {
-    assert(ecmd->type == EXEC);
+    free(dc->names);
+    free(dc->data);
+    free(dc);
+}
 
-    if (ecmd->argv[0] == NULL) exit(EXIT_SUCCESS);
 
-    execvp(ecmd->argv[0], ecmd->argv);
+// Lee el directorio abierto en `fd` y devuelve su listado ordenado
+struct dircache* scan_dir(int fd, struct stat* st)
+{
+    static char* dents = NULL;
+    struct dircache* dc;
+    size_t len = 0, size = BSIZE * 16;
+    ssize_t n;
+
+    if (dents == NULL && (dents = malloc(GLOB_DENTS_SIZE)) == NULL)
+    {
+        perror("scan_dir: malloc");
+        exit(EXIT_FAILURE);
+    }
+    if ((dc = calloc(1, sizeof(*dc))) == NULL || (dc->data = malloc(size)) == NULL)
+    {
+        perror("scan_dir: malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    while ((n = getdents64(fd, dents, GLOB_DENTS_SIZE)) > 0)
+    {
+        for (ssize_t off = 0; off < n; )
+        {
+            struct dirent64* d = (struct dirent64*) (dents + off);
+            size_t nlen = strlen(d->d_name);
+
+            off += d->d_reclen;
+            if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+                continue;
+            while (len + nlen + 2 > size)
+                if ((dc->data = realloc(dc->data, size *= 2)) == NULL)
+                {
+                    perror("scan_dir: realloc");
+                    exit(EXIT_FAILURE);
+                }
+            dc->data[len] = d->d_type;
+            memcpy(dc->data + len + 1, d->d_name, nlen + 1);
+            len += nlen + 2;
+            dc->count++;
+        }
+    }
+    if (n < 0)
+    {
+        free_dircache(dc);
+        return NULL;
+    }
+
+    // Los punteros se calculan al final porque `realloc` mueve los datos
+    if ((dc->names = malloc((dc->count + 1) * sizeof(char*))) == NULL)
+    {
+        perror("scan_dir: malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0, off = 0; off < len; i++)
+    {
+        dc->names[i] = dc->data + off;
+        off += strlen(dc->data + off + 1) + 2;
+    }
+    qsort(dc->names, dc->count, sizeof(char*), cmp_names);
 
-    panic("no se encontró el comando '%s'\n", ecmd->argv[0]);
+    dc->dev = st->st_dev;
+    dc->ino = st->st_ino;
+    dc->mtime = st->st_mtim;
+    dc->scanned = time(NULL);
+    return dc;
 }
 
 
-void run_cmd(struct cmd* cmd,struct sigaction * sa)
+// Devuelve el listado del directorio `path`, de la caché si sigue siendo
+// válido. Devuelve NULL si no se puede leer.
+struct dircache* list_dir(const char* path)
 {
-    struct execcmd* ecmd;
-    struct redrcmd* rcmd;
-    struct listcmd* lcmd;
-    struct pipecmd* pcmd;
-    struct backcmd* bcmd;
-    struct subscmd* scmd;
-    int p[2];
+    struct dircache** prev;
+    struct dircache* dc;
+    struct stat st;
     int fd;
 
-    DPRINTF(DBG_TRACE, "STR\n");
+    if ((fd = open(*path ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0)
+    {
+        TRY( close(fd) );
+        return NULL;
+    }
 
-    if(cmd == 0) return;
+    for (prev = &g_dircache; (dc = *prev) != NULL; prev = &dc->next)
+    {
+        if (dc->dev != st.st_dev || dc->ino != st.st_ino)
+            continue;
+        *prev = dc->next;
+        g_dircache_count--;
+        if (dc->mtime.tv_sec == st.st_mtim.tv_sec &&
+                dc->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+                dc->mtime.tv_sec < dc->scanned - 1)
+        {
+            DPRINTF(DBG_TRACE, "glob: %s en caché\n", path);
+            TRY( close(fd) );
+            break;
+        }
+        free_dircache(dc);
+        dc = NULL;
+        break;
+    }
 
-    switch(cmd->type)
+    if (dc == NULL)
     {
-        case EXEC:
-            	TRY(sigprocmask(SIG_BLOCK, &sa->sa_mask,NULL));
-            ecmd = (struct execcmd*) cmd;
-
-            if(is_internal(ecmd->argv[0])){
-                run_internal_exec(ecmd);
-                
-            } 
-                
-            else{
-                pid_t pid;
-                if ((pid = fork_or_panic("fork EXEC")) == 0)
-                    exec_cmd(ecmd);
-                
-                TRY( waitpid(pid,NULL,0) );    
-            }
-            	TRY(sigprocmask(SIG_UNBLOCK, &sa->sa_mask,NULL));
-
-
-            break;
+        dc = scan_dir(fd, &st);
+        TRY( close(fd) );
+        if (dc == NULL)
+            return NULL;
+    }
 
-        case REDR:
-            rcmd = (struct redrcmd*) cmd;
-            /* Cuando se tiene que ejecutar un comando interno, 
-               no se debe crear un proceso hijo. 
-               No obstante, sí que se debe realizar la redirección.*/
-            struct execcmd * ecmd = (struct execcmd *)rcmd->cmd;
-            if(is_internal(ecmd->argv[0])){
-				int stdout_copy = dup(1); 
-                TRY( close(rcmd->fd) );
-                if ((fd = open(rcmd->file, rcmd->flags, rcmd->mode)) < 0)
-                {
-                    perror("open");
-                    exit(EXIT_FAILURE);
-                }
+    // El listado usado más recientemente pasa al principio; si la caché está
+    // llena se descarta el último
+    dc->next = g_dircache;
+    g_dircache = dc;
+    if (++g_dircache_count > GLOB_CACHE_DIRS)
+    {
+        for (prev = &g_dircache; (*prev)->next; prev = &(*prev)->next)
+            ;
+        free_dircache(*prev);
+        *prev = NULL;
+        g_dircache_count--;
+    }
 
-                run_internal_exec(ecmd);
-                TRY(dup2(stdout_copy,STDOUT_FILENO)); 
-            }else{
-		        TRY(sigprocmask(SIG_BLOCK, &sa->sa_mask,NULL));
-                pid_t pid;
-                 if ((pid = fork_or_panic("fork REDR")) == 0)
-                {
-                TRY( close(rcmd->fd) );
-                if ((fd = open(rcmd->file, rcmd->flags, rcmd->mode)) < 0)
-                {
-                    perror("open");
-                    exit(EXIT_FAILURE);
-                }
+    return dc;
+}
 
-                if (rcmd->cmd->type == EXEC){
-                    exec_cmd((struct execcmd*) rcmd->cmd);
-                }else
-                    run_cmd(rcmd->cmd,sa);
-                exit(EXIT_SUCCESS);
-                }
-                TRY( waitpid(pid,NULL,0) );
-		        TRY(sigprocmask(SIG_UNBLOCK, &sa->sa_mask,NULL));
-            }
-           
-            break;
 
-        case LIST:
-            lcmd = (struct listcmd*) cmd;
-            run_cmd(lcmd->left,sa);
-            run_cmd(lcmd->right,sa);
-            break;
+// `glob_path` añade a `out` las rutas que encajan con `pattern` a partir de
+// la ruta ya construida en `path` (de longitud `len`)
+void glob_path(char* path, size_t len, const char* pattern, struct argvec* out)
+{
+    char comp[NAME_MAX + 1];
+    const char* rest;
+    struct dircache* dc;
+    struct stat st;
+    size_t clen;
+
+    while (*pattern == '/')
+        pattern++;
+    if ((rest = strchr(pattern, '/')) == NULL)
+        rest = pattern + strlen(pattern);
+    if ((clen = rest - pattern) > NAME_MAX)
+        return;
+    memcpy(comp, pattern, clen);
+    comp[clen] = 0;
+
+    if (len > 0 && path[len - 1] != '/')
+        path[len++] = '/';
+
+    // Un componente sin comodines no necesita leer el directorio
+    if (!has_glob(comp))
+    {
+        if (len + clen >= PATH_MAX)
+            return;
+        memcpy(path + len, comp, clen + 1);
+        if (*rest && rest[strspn(rest, "/")])
+            glob_path(path, len + clen, rest, out);
+        else if (lstat(path, &st) == 0)
+            argvec_push(out, path);
+        return;
+    }
 
-        case PIPE:
-            pcmd = (struct pipecmd*)cmd;
-            TRY(sigprocmask(SIG_BLOCK, &sa->sa_mask,NULL));
-            
-            if (pipe(p) < 0)
-            {
-                perror("pipe");
-                exit(EXIT_FAILURE);
-            }
-			pid_t pid_left,pid_right;
-            // Ejecución del hijo de la izquierda
-            if ((pid_left = fork_or_panic("fork PIPE left")) == 0)
-            {
-                TRY( close(STDOUT_FILENO) );
-                TRY( dup(p[1]) );
-                TRY( close(p[0]) );
-                TRY( close(p[1]) );
-                if (pcmd->left->type == EXEC){
-                	struct execcmd * ecmd = (struct execcmd *)pcmd->left;
-                	if(is_internal(ecmd->argv[0])){
-							run_internal_exec(ecmd);
-					}else {
-						exec_cmd((struct execcmd*) pcmd->left);
-					}
-                
-                }
-                	  
-                else
-                    run_cmd(pcmd->left,sa);
-                exit(EXIT_SUCCESS);
-            }
+    path[len] = 0;
+    if ((dc = list_dir(path)) == NULL)
+        return;
 
-            // Ejecución del hijo de la derecha
-            
-            if ((pid_right = fork_or_panic("fork PIPE right")) == 0){
-                TRY( close(STDIN_FILENO) );
-                TRY( dup(p[0]) );
-                TRY( close(p[0]) );
-                TRY( close(p[1]) );
-                if (pcmd->right->type == EXEC){
-					struct execcmd * ecmd = (struct execcmd *)pcmd->right;
-                	if(is_internal(ecmd->argv[0])){
-						run_internal_exec(ecmd);
-					}else
-                        exec_cmd((struct execcmd*) pcmd->right);                
-                }
-                else
-                    run_cmd(pcmd->right,sa);
-                exit(EXIT_SUCCESS);
-            }
-            TRY( close(p[0]) );
-            TRY( close(p[1]) );
+    for (int i = 0; i < dc->count; i++)
+    {
+        char* name = dc->names[i] + 1;
+        unsigned char type = dc->names[i][0];
+        size_t nlen = strlen(name);
 
-            // Esperar a ambos hijos
-            TRY( waitpid(pid_left,NULL,0) );
-            TRY( waitpid(pid_right,NULL,0) );
-            TRY(sigprocmask(SIG_UNBLOCK, &sa->sa_mask,NULL));
+        if (fnmatch(comp, name, FNM_PERIOD) != 0 || len + nlen >= PATH_MAX)
+            continue;
+        memcpy(path + len, name, nlen + 1);
 
-            break;
+        if (!*rest)
+        {
+            argvec_push(out, path);
+            continue;
+        }
+        // Quedan componentes: sólo sirven los directorios
+        if (type != DT_DIR)
+        {
+            if (type != DT_LNK && type != DT_UNKNOWN)
+                continue;
+            if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode))
+                continue;
+        }
+        if (rest[strspn(rest, "/")])
+            glob_path(path, len + nlen, rest, out);
+        else
+        {
+            // Patrón terminado en `/`: como en bash, se conserva
+            path[len + nlen] = '/';
+            path[len + nlen + 1] = 0;
+            argvec_push(out, path);
+        }
+    }
+}
 
-        case BACK:
-            bcmd = (struct backcmd*)cmd;
-            pid_t pid;
-            if ((pid = fork_or_panic("fork BACK")) == 0)
-            {
-                if (bcmd->cmd->type == EXEC) {
-                	struct execcmd * ecmd = (struct execcmd *)bcmd->cmd;
-                	if(is_internal(ecmd->argv[0])){
-								run_internal_exec(ecmd);
-                	}else
-                    exec_cmd((struct execcmd*) bcmd->cmd);
-                }
-                else
-                    run_cmd(bcmd->cmd,sa);
-                exit(EXIT_SUCCESS);
-            }
-            
-            
-            insert_process(pid);
-            printf("[%d]\n",pid); // Indicamos que empieza el proceso con su [PID]
-            fflush(stdout);
 
-            break;
+// `expand_argv` sustituye los argumentos de `ecmd` con comodines por los
+// nombres de fichero que encajan con ellos. Los argumentos con comillas se
+// dejan tal cual. Si hay alguno, `ecmd->argv`
+// pasa a apuntar a un vector nuevo que se libera con `free_argv`.
+void expand_argv(struct execcmd* ecmd)
+{
+    struct argvec out = { NULL, 0, 0 };
+    char path[PATH_MAX + 1];
+    int i, n;
 
-        case SUBS:
-            scmd = (struct subscmd*) cmd;
-            pid_t pids;
-		    TRY(sigprocmask(SIG_UNBLOCK, &sa->sa_mask,NULL));            
-	        if ((pids = fork_or_panic("fork SUBS")) == 0)
-            {
-                run_cmd(scmd->cmd,sa);
-                exit(EXIT_SUCCESS);
-            }
-            TRY( waitpid(pids,NULL,0) );
-	TRY(sigprocmask(SIG_UNBLOCK, &sa->sa_mask,NULL));
+    for (i = 0; ecmd->argv[i]; i++)
+        if (!(ecmd->noglob & (1u << i)) && has_glob(ecmd->argv[i]))
             break;
+    if (ecmd->argv[i] == NULL || ecmd->argv != ecmd->words)
+        return;
 
-        case INV:
-        default:
-            panic("%s: estructura `cmd` desconocida\n", __func__);
+    for (i = 0; ecmd->argv[i]; i++)
+    {
+        n = out.n;
+        if (!(ecmd->noglob & (1u << i)) && has_glob(ecmd->argv[i]))
+        {
+            path[0] = 0;
+            if (ecmd->argv[i][0] == '/')
+                strcpy(path, "/");
+            glob_path(path, strlen(path), ecmd->argv[i], &out);
+        }
+        // Sin coincidencias el argumento se pasa literalmente
+        if (out.n == n)
+            argvec_push(&out, ecmd->argv[i]);
     }
 
-    DPRINTF(DBG_TRACE, "END\n");
+    ecmd->argv = out.v;
+    ecmd->argc = out.n;
 }
 
 
-void print_cmd(struct cmd* cmd)
+// `free_argv` libera el vector de argumentos construido por `expand_argv`
+void free_argv(struct execcmd* ecmd)
 {
-    struct execcmd* ecmd;
-    struct redrcmd* rcmd;
-    struct listcmd* lcmd;
-    struct pipecmd* pcmd;
-    struct backcmd* bcmd;
-    struct subscmd* scmd;
+    if (ecmd->argv == ecmd->words)
+        return;
+
+    for (int i = 0; ecmd->argv[i]; i++)
+        free(ecmd->argv[i]);
+    free(ecmd->argv);
+    ecmd->argv = ecmd->words;
+    for (ecmd->argc = 0; ecmd->words[ecmd->argc]; ecmd->argc++)
+        ;
+}
 
-    if(cmd == 0) return;
 
-    switch(cmd->type)
-    {
-        case EXEC:
-            ecmd = (struct execcmd*) cmd;
-            if (ecmd->argv[0] != 0)
-                printf("fork( exec( %s ) )", ecmd->argv[0]);
-            break;
+/******************************************************************************
+ * Funciones para la ejecución de la línea de órdenes
+ ******************************************************************************/
+void run_cwd();
+void run_exit();
+void run_cd(struct execcmd *);
+void run_psplit(struct execcmd *);
+void run_bjobs(struct execcmd *);
+void run_pipesz(struct execcmd *);
+void run_echo(struct execcmd *);
+void run_true(struct execcmd *);
+void run_cat(struct execcmd *);
+void run_tee(struct execcmd *);
+void run_history(struct execcmd *);
+void run_affinity(struct execcmd *);
+void run_bclass(struct execcmd *);
+void run_memo(struct execcmd *);
+void run_meter(struct execcmd *);
+void run_timeout(struct execcmd *);
+int apply_prio_class(pid_t, const struct prio_class*);
+int place_pipeline();
+void place_stage(int, int);
+void place_worker(int);
+void startup_mark(const char*);
+void startup_report();
+void insert_process(pid_t pid);
+int jobs_running();
+void enqueue_job(struct cmd*);
+void start_job(struct cmd*);
+_Noreturn void run_tail(struct cmd*);
+int write_all(int, const char*, size_t);
+int wait_child(pid_t);
 
-        case REDR:
-            rcmd = (struct redrcmd*) cmd;
-            printf("fork( ");
-            if (rcmd->cmd->type == EXEC)
-                printf("exec ( %s )", ((struct execcmd*) rcmd->cmd)->argv[0]);
-            else
-                print_cmd(rcmd->cmd);
-            printf(" )");
-            break;
 
-        case LIST:
-            lcmd = (struct listcmd*) cmd;
-            print_cmd(lcmd->left);
-            printf(" ; ");
-            print_cmd(lcmd->right);
-            break;
+// `set_status` guarda en `g_status` el estado de terminación `wstatus`
+// devuelto por `waitpid` (128 + N si el proceso murió por la señal N)
+void set_status(int wstatus)
+{
+    if (WIFEXITED(wstatus))
+        g_status = WEXITSTATUS(wstatus);
+    else if (WIFSIGNALED(wstatus))
+        g_status = 128 + WTERMSIG(wstatus);
+}
 
-        case PIPE:
-            pcmd = (struct pipecmd*) cmd;
-            printf("fork( ");
-            if (pcmd->left->type == EXEC)
-                printf("exec ( %s )", ((struct execcmd*) pcmd->left)->argv[0]);
-            else
-                print_cmd(pcmd->left);
-            printf(" ) => fork( ");
-            if (pcmd->right->type == EXEC)
-                printf("exec ( %s )", ((struct execcmd*) pcmd->right)->argv[0]);
-            else
-                print_cmd(pcmd->right);
-            printf(" )");
-            break;
+int is_internal(char * command)
+{
+    for (int i = 0; i < NUM_INTERNAL_COMMANDS; i++)
+    {
+        if(command != NULL && !strcmp(command,internal_commands[i]))
+            return 1;
+    }
+    return 0;
+}
 
-        case BACK:
-            bcmd = (struct backcmd*) cmd;
-            printf("fork( ");
-            if (bcmd->cmd->type == EXEC)
-                printf("exec ( %s )", ((struct execcmd*) bcmd->cmd)->argv[0]);
-            else
-                print_cmd(bcmd->cmd);
-            printf(" )");
-            break;
 
-        case SUBS:
-            scmd = (struct subscmd*) cmd;
-            printf("fork( ");
-            print_cmd(scmd->cmd);
-            printf(" )");
-            break;
+void run_internal_exec(struct execcmd * cmd)
+{
+	 char * command = cmd->argv[0];
 
-        case INV:
-        default:
-            panic("%s: estructura `cmd` desconocida\n", __func__);
+    // `getopt` guarda un puntero al último grupo de opciones que analizó, que
+    // apunta a una línea ya liberada: con `optind = 0` se reinicia y lo olvida
+    optind = 0;
+    getopt(1, (char*[]) { command, NULL }, "");
+    if(!strcmp(command,"cwd")){
+        run_cwd();
+    } else if(!strcmp(command,"exit")) {
+		  run_exit(cmd);    
+    } else if(!strcmp(command,"cd")) {
+		  run_cd(cmd);    
+    }else if(!strcmp(command,"psplit")){
+        run_psplit(cmd);
+    }else if(!strcmp(command,"bjobs")){
+        run_bjobs(cmd);
+    }else if(!strcmp(command,"pipesz")){
+        run_pipesz(cmd);
+    }else if(!strcmp(command,"echo")){
+        run_echo(cmd);
+    }else if(!strcmp(command,"true")){
+        run_true(cmd);
+    }else if(!strcmp(command,"cat")){
+        run_cat(cmd);
+    }else if(!strcmp(command,"tee")){
+        run_tee(cmd);
+    }else if(!strcmp(command,"history")){
+        run_history(cmd);
+    }else if(!strcmp(command,"affinity")){
+        run_affinity(cmd);
+    }else if(!strcmp(command,"bclass")){
+        run_bclass(cmd);
+    }else if(!strcmp(command,"memo")){
+        run_memo(cmd);
+    }else if(!strcmp(command,"meter")){
+        run_meter(cmd);
+    }else if(!strcmp(command,"timeout")){
+        run_timeout(cmd);
     }
 }
 
-
-void free_cmd(struct cmd* cmd)
+// `run_builtin` ejecuta la orden interna `ecmd` en el propio shell. Mientras
+// tanto SIGPIPE se ignora: si quien lee su salida termina antes, la orden
+// recibe EPIPE y se detiene con el estado 141 (128 + SIGPIPE), pero el shell
+// sigue vivo.
+void run_builtin(struct execcmd* ecmd)
 {
-    struct execcmd* ecmd;
-    struct redrcmd* rcmd;
-    struct listcmd* lcmd;
-    struct pipecmd* pcmd;
-    struct backcmd* bcmd;
-    struct subscmd* scmd;
-
-    if(cmd == 0) return;
+    struct sigaction ign = { .sa_handler = SIG_IGN }, old;
 
-    switch(cmd->type)
+    TRY( sigaction(SIGPIPE, &ign, &old) );
+    g_status = 0;
+    run_internal_exec(ecmd);
+    if (fflush(stdout) == EOF)
     {
-        case EXEC:
-            break;
+        if (g_status == 0)
+            g_status = errno == EPIPE ? 128 + SIGPIPE : 1;
+        // Lo que no se pudo escribir no debe acabar en la salida restaurada
+        __fpurge(stdout);
+        clearerr(stdout);
+    }
+    TRY( sigaction(SIGPIPE, &old, NULL) );
+}
 
-        case REDR:
-            rcmd = (struct redrcmd*) cmd;
-            free_cmd(rcmd->cmd);
+void exec_cmd(struct execcmd* ecmd)
+{
+    assert(ecmd->type == EXEC);
 
-            free(rcmd->cmd);
-            break;
+    if (ecmd->argv[0] == NULL) exit(EXIT_SUCCESS);
 
-        case LIST:
-            lcmd = (struct listcmd*) cmd;
+    // SIGCHLD solo está bloqueada para el bucle de eventos del shell
+    TRY(sigprocmask(SIG_UNBLOCK, &g_sigchld_mask, NULL));
 
-            free_cmd(lcmd->left);
-            free_cmd(lcmd->right);
+    // `command ORDEN` ejecuta siempre el programa externo aunque exista una
+    // orden interna con el mismo nombre
+    char** argv = ecmd->argv;
+    if (!strcmp(argv[0], "command"))
+        argv++;
+    if (argv[0] == NULL) exit(EXIT_SUCCESS);
 
-            free(lcmd->right);
-            free(lcmd->left);
-            break;
+    execvp(argv[0], argv);
 
-        case PIPE:
-            pcmd = (struct pipecmd*) cmd;
+    // Como en POSIX, 127 indica que no se encontró la orden
+    fprintf(stderr, "%s: no se encontró el comando '%s'\n", __FILE__, argv[0]);
+    exit(127);
+}
 
-            free_cmd(pcmd->left);
-            free_cmd(pcmd->right);
 
-            free(pcmd->right);
-            free(pcmd->left);
-            break;
+// `exec_argv_tail` ejecuta, en el hijo de una orden interna que lanza otra
+// orden (`affinity -c`, `memo`, `timeout`), los argumentos de `cmd` a partir
+// de `first`: como orden interna si lo son y, si no, con `exec_cmd`, de modo
+// que `command` también funciona. Nunca retorna.
+_Noreturn void exec_argv_tail(struct execcmd* cmd, int first)
+{
+    cmd->argv += first;
+    cmd->argc -= first;
+    if (is_internal(cmd->argv[0]))
+    {
+        g_status = 0;
+        run_internal_exec(cmd);
+        fflush(stdout);
+        exit(g_status);
+    }
+    exec_cmd(cmd);
+    exit(EXIT_FAILURE);
+}
 
-        case BACK:
-            bcmd = (struct backcmd*) cmd;
 
-            free_cmd(bcmd->cmd);
+// Lee el entero de /proc/sys/fs/`name` o devuelve 0
+long read_fs_sysctl(const char* name)
+{
+    char path[64];
+    FILE* f;
+    long value = 0;
 
-            free(bcmd->cmd);
-            break;
+    snprintf(path, sizeof(path), "/proc/sys/fs/%s", name);
+    if ((f = fopen(path, "r")) != NULL)
+    {
+        if (fscanf(f, "%ld", &value) != 1)
+            value = 0;
+        fclose(f);
+    }
+    return value;
+}
 
-        case SUBS:
-            scmd = (struct subscmd*) cmd;
 
-            free_cmd(scmd->cmd);
+// Capacidad de `pipesz auto`: la máxima que permite el sistema a un usuario
+// sin privilegios, limitada a `MAX_PIPE_SIZE` y a lo que deja
+// /proc/sys/fs/pipe-user-pages-soft para `AUTO_PIPES` tuberías a la vez.
+// Pasado ese límite el núcleo reduce las tuberías nuevas del usuario a una
+// página, así que no conviene agotarlo.
+int auto_pipe_size()
+{
+    long max = read_fs_sysctl("pipe-max-size");
+    long soft = read_fs_sysctl("pipe-user-pages-soft") * sysconf(_SC_PAGESIZE) / AUTO_PIPES;
+
+    if (max > MAX_PIPE_SIZE)
+        max = MAX_PIPE_SIZE;
+    if (soft > 0 && soft < max)
+        max = soft;
+    return max;
+}
 
-            free(scmd->cmd);
-            break;
 
-        case INV:
-        default:
-            panic("%s: estructura `cmd` desconocida\n", __func__);
-    }
+// `pipe_sized` crea una tubería con la capacidad configurada con `pipesz`
+int pipe_sized(int p[2])
+{
+    if (pipe(p) < 0)
+        return -1;
+
+    // Es solo una mejora: si el sistema no lo permite (p. ej. por superar
+    // /proc/sys/fs/pipe-user-pages-soft) se sigue con la capacidad por defecto
+    if (g_pipe_size > 0 && fcntl(p[1], F_SETPIPE_SZ, g_pipe_size) < 0)
+        DPRINTF(DBG_TRACE, "F_SETPIPE_SZ %d: %s\n", g_pipe_size, strerror(errno));
+
+    return 0;
 }
 
 
-/******************************************************************************
- * Lectura de la línea de órdenes con la biblioteca libreadline
- ******************************************************************************/
+// `here_fd` devuelve un descriptor de sólo lectura con el contenido de un
+// here-document o here-string. Los datos se guardan en un fichero anónimo en
+// memoria (`memfd`) sellado contra escritura: no se crean ficheros temporales
+// ni procesos auxiliares, y quien lo recibe puede hacer `lseek` sobre él.
+int here_fd(struct redrcmd* rcmd)
+{
+    int fd;
+    const char* data = rcmd->kind == REDR_HEREDOC ? rcmd->data : rcmd->file;
 
+    TRY( fd = memfd_create("simplesh-here", MFD_CLOEXEC | MFD_ALLOW_SEALING) );
+    if ((data && write_all(fd, data, strlen(data)) < 0) ||
+        (rcmd->kind == REDR_HERESTR && write_all(fd, "\n", 1) < 0))
+    {
+        perror("here_fd: write");
+        exit(EXIT_FAILURE);
+    }
+    TRY( fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) );
+    TRY( lseek(fd, 0, SEEK_SET) );
 
-// `get_cmd` muestra un *prompt* y lee lo que el usuario escribe usando la
-// biblioteca readline. Ésta permite mantener el historial, utilizar las flechas
-// para acceder a las órdenes previas del historial, búsquedas de órdenes, etc.
+    return fd;
+}
 
-char* get_cmd()
+
+// `apply_redr` aplica la redirección `rcmd` sobre su descriptor. Si `save`
+// es distinto de 0, antes guarda una copia del descriptor para que
+// `restore_redrs` pueda deshacerla. Devuelve -1 si no se puede realizar.
+int apply_redr(struct redrcmd* rcmd, int save)
 {
-    uid_t uid = getuid();
-    struct passwd * passwd = getpwuid(uid);
-	if(!passwd){
-		perror("getpwuid");
-		exit(EXIT_FAILURE);
-	}
+    int fd;
 
-	char * user = passwd->pw_name;
-	char path[PATH_MAX];
-	if(!getcwd(path,PATH_MAX)){
-		perror("getcwd");
-		exit(EXIT_FAILURE);
-	}
+    rcmd->saved = -1;
+    if (save && (rcmd->saved = fcntl(rcmd->fd, F_DUPFD_CLOEXEC, 10)) < 0 && errno != EBADF)
+        TRY( -1 );
+
+    switch (rcmd->kind)
+    {
+        case REDR_FILE:
+            if ((fd = open(rcmd->file, rcmd->flags, rcmd->mode)) < 0)
+            {
+                error("%s: %s\n", rcmd->file, strerror(errno));
+                return -1;
+            }
+            break;
 
-	char * dir = basename(path);
-	char prompt[strlen(user)+strlen(dir)+4];
-	sprintf(prompt,"%s@%s> ",user,dir);
-   // Lee la orden tecleada por el usuario
-    char * buf = readline(prompt);
+        case REDR_HEREDOC:
+        case REDR_HERESTR:
+            fd = here_fd(rcmd);
+            break;
 
-    
-  
-    // Si el usuario ha escrito una orden, almacenarla en la historia.
-    if(buf)
-        add_history(buf);
+        case REDR_DUP:
+            if (dup2(atoi(rcmd->file), rcmd->fd) < 0)
+            {
+                error("%s: descriptor erróneo\n", rcmd->file);
+                return -1;
+            }
+            return 0;
 
-    return buf;
+        case REDR_CLOSE:
+            if (close(rcmd->fd) < 0 && errno != EBADF)
+                TRY( -1 );
+            return 0;
+
+        default:
+            panic("%s: redirección desconocida\n", __func__);
+    }
+
+    if (fd != rcmd->fd)
+    {
+        TRY( dup2(fd, rcmd->fd) );
+        TRY( close(fd) );
+    }
+    return 0;
 }
 
-void insert_process(pid_t pid){
-    
-    for(int i = 0;i < MAX_PIDS; i++ ) {
-        if(processes[i] == -1){
-            processes[i] = pid;
-            break;
+
+// Deshace las redirecciones de una cadena de estructuras `REDR` aplicadas por
+// `apply_redrs` con `save`, en orden inverso al de aplicación.
+void restore_redrs(struct cmd* cmd)
+{
+    struct redrcmd* rcmd;
+
+    for (; cmd && cmd->type == REDR; cmd = rcmd->cmd)
+    {
+        rcmd = (struct redrcmd*) cmd;
+        if (rcmd->saved >= 0)
+        {
+            TRY( dup2(rcmd->saved, rcmd->fd) );
+            TRY( close(rcmd->saved) );
         }
+        else if (close(rcmd->fd) < 0 && errno != EBADF)
+            TRY( -1 );
+        rcmd->saved = -1;
     }
 }
 
 
-void handle_sigchld(int sig) {
-
+// `apply_redrs` aplica en una sola pasada todas las redirecciones de una orden
+// (la cadena de estructuras `REDR` que la envuelve) en el orden en el que
+// aparecen en la línea, de modo que la última redirección de un descriptor es
+// la que prevalece. Devuelve la orden a ejecutar, o NULL si alguna redirección
+// falla (en cuyo caso, con `save`, se deshacen las ya aplicadas).
+struct cmd* apply_redrs(struct cmd* cmd, int save)
+{
+    struct redrcmd* rcmd;
+    struct cmd* inner;
 
-    int saved_errno = errno;
-    char message[14];
-    pid_t pid;
+    if (cmd->type != REDR)
+        return cmd;
 
-    while ((pid = waitpid((pid_t)(-1), 0, WNOHANG)) > 0) 
+    // La estructura más interna es la primera redirección de la línea
+    rcmd = (struct redrcmd*) cmd;
+    if ((inner = apply_redrs(rcmd->cmd, save)) == NULL)
+        return NULL;
+    if (apply_redr(rcmd, save) < 0)
     {
-        
-        sprintf(message,"[%d]\n",pid); 
-        for(int i= 0; i< MAX_PIDS;i++){
-            if(processes[i]==pid){  
-                processes[i] = -1;
-            }
-        } 
-        
-        TRY(write(STDOUT_FILENO,message,strlen(message))); // reentrant
+        if (save)
+            restore_redrs(rcmd->cmd);
+        return NULL;
     }
-   
+    return inner;
+}
+
+
+void run_cmd(struct cmd*);
+_Noreturn void run_tail(struct cmd*);
+
+
+// `start_psubs` lanza las órdenes de las sustituciones de proceso de `ecmd`.
+// Cada una se conecta a una tubería cuyo otro extremo se queda abierto (sin
+// `O_CLOEXEC`, para que lo herede el programa) y su ruta `/dev/fd/N` pasa a
+// ser el argumento correspondiente. Si ya se han lanzado no hace nada.
+void start_psubs(struct execcmd* ecmd)
+{
+    int p[2], keep, give;
+
+    for (struct psubcmd* psub = ecmd->psubs; psub; psub = psub->next)
+    {
+        if (psub->pid != -1)
+            continue;
+
+        if (pipe2(p, O_CLOEXEC) < 0)
+        {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+        // `<(cmd)`: `cmd` escribe y la orden lee; `>(cmd)` al revés
+        keep = psub->dir == '<' ? p[0] : p[1];
+        give = psub->dir == '<' ? p[1] : p[0];
+
+        if ((psub->pid = fork_or_panic("fork PSUB")) == 0)
+        {
+            TRY( dup2(give, psub->dir == '<' ? STDOUT_FILENO : STDIN_FILENO) );
+            // Los extremos de las sustituciones anteriores no son de este
+            // proceso: si los mantuviera, `>(...)` nunca vería el fin de fichero
+            for (struct psubcmd* prev = ecmd->psubs; prev != psub; prev = prev->next)
+                TRY( close(prev->fd) );
+            run_tail(psub->cmd);
+        }
 
-    errno = saved_errno;
+        TRY( close(give) );
+        TRY( fcntl(keep, F_SETFD, 0) );
+        psub->fd = keep;
+        snprintf(psub->path, sizeof(psub->path), "/dev/fd/%d", keep);
+    }
 }
 
-void run_cwd()
+
+// `close_psubs` cierra los extremos de las sustituciones de proceso de `ecmd`
+// que conserva el shell, de modo que no retengan a sus órdenes
+void close_psubs(struct execcmd* ecmd)
 {
-    	uid_t uid = getuid();
-    	struct passwd * passwd = getpwuid(uid);
-	if(!passwd){
-		perror("getpwuid");
-		exit(EXIT_FAILURE);
-	}
+    for (struct psubcmd* psub = ecmd->psubs; psub; psub = psub->next)
+    {
+        if (psub->fd != -1)
+            TRY( close(psub->fd) );
+        psub->fd = -1;
+    }
+}
 
-	char * user = passwd->pw_name;
-	char path[PATH_MAX];
-	if(!getcwd(path,PATH_MAX)){
-		perror("getcwd");
-		exit(EXIT_FAILURE);
-	}
 
-	
-	char prompt[strlen(path)+8];
-	sprintf(prompt,"cwd: %s\n",path);
-    	printf("%s",prompt);
-   
+// `wait_psubs` espera a que terminen las órdenes de las sustituciones de
+// proceso de `ecmd` y las deja listas para volver a ejecutarse
+void wait_psubs(struct execcmd* ecmd)
+{
+    close_psubs(ecmd);
+    for (struct psubcmd* psub = ecmd->psubs; psub; psub = psub->next)
+    {
+        if (psub->pid != -1)
+            wait_child(psub->pid);
+        psub->pid = -1;
+        psub->path[0] = 0;
+    }
 }
 
-void run_exit(struct cmd * ecmd) 
-{		
-	free_cmd(ecmd);
-	free(ecmd);
-	exit(EXIT_SUCCESS);
+
+// Lanza las sustituciones de proceso de la orden a la que se aplican las
+// redirecciones `cmd`
+void start_redr_psubs(struct cmd* cmd)
+{
+    while (cmd->type == REDR)
+        cmd = ((struct redrcmd*) cmd)->cmd;
+    if (cmd->type == EXEC)
+        start_psubs((struct execcmd*) cmd);
 }
 
-void run_cd(struct execcmd * cmd) 
-{	
-    static int num_cd = 0; // Para mantener estado entre llamadas
-	char path[PATH_MAX];
-	if(!getcwd(path,PATH_MAX)){
-		perror("getcwd");
-		exit(EXIT_FAILURE);
-	}
-    /* Si es el primer cd que se realiza en el shell 
-       y trata de realizar cd - se lanzara un mensaje de error y 
-       no se aumentará el numero de cd realizados*/
-	char * arg1 = cmd->argv[1];
-	if(!num_cd) {
-		setenv("OLDPWD",path,1);	
-		if(arg1 == NULL) {
-			TRY(chdir(getenv("HOME"))); 
-		    num_cd++;
-        }else if(!strcmp(arg1,"-")){
-			printf("run_cd: Variable OLDPWD no definida\n");
-		}else if(cmd->argv[2] != NULL) {
-			printf("run_cd: Demasiados argumentos\n");
-		}else {
-			
-			if(chdir(arg1) == -1)
-				printf("run_cd: No existe el directorio '%s'\n",arg1);
-            num_cd++;	
-		}	
-	} else {
-		if(arg1 == NULL) {
-			TRY(chdir(getenv("HOME")));
-		}else if(!strcmp(arg1,"-")){
-			TRY(chdir(getenv("OLDPWD")));
-		}else if(cmd->argv[2] != NULL) {
-			printf("run_cd: Demasiados argumentos\n");
-		}else {
 
-			if(chdir(arg1) == -1){
-			    printf("run_cd: No existe el directorio '%s'\n",arg1);
+// `run_pipeline` lanza cada etapa de `pcmd` (`a | b | c` es `a | (b | c)`)
+// en un hijo de este mismo proceso y las espera todas, de modo que ninguna
+// queda sin recoger. Devuelve el estado de la última, como `waitpid`. Con
+// `affinity -P on` cada etapa se fija a la CPU siguiente del orden compacto.
+int run_pipeline(struct pipecmd* pcmd)
+{
+    struct cmd* cmd;
+    pid_t* pids;
+    int n = 1, started, in = -1, p[2], base = 0, status = W_EXITCODE(EXIT_FAILURE, 0);
+
+    for (cmd = (struct cmd*) pcmd; cmd->type == PIPE; cmd = ((struct pipecmd*) cmd)->right)
+        n++;
+    if ((pids = malloc(n * sizeof(pids[0]))) == NULL)
+    {
+        perror("run_pipeline: malloc");
+        return status;
+    }
+    if (g_placement)
+        base = place_pipeline();
+
+    cmd = (struct cmd*) pcmd;
+    for (started = 0; started < n; started++)
+    {
+        int last = started == n - 1;
+        struct cmd* stage = last ? cmd : ((struct pipecmd*) cmd)->left;
+
+        if (!last && pipe_sized(p) < 0)
+        {
+            perror("pipe");
+            break;
+        }
+        if ((pids[started] = fork_or_panic("fork PIPE")) == 0)
+        {
+            if (g_placement)
+                place_stage(base, started);
+            if (in != -1)
+            {
+                TRY( dup2(in, STDIN_FILENO) );
+                TRY( close(in) );
             }
-		}
-		TRY(setenv("OLDPWD",path,1));
-        num_cd++;
-	}
+            if (!last)
+            {
+                TRY( dup2(p[1], STDOUT_FILENO) );
+                TRY( close(p[0]) );
+                TRY( close(p[1]) );
+            }
+            run_tail(stage);
+        }
+        if (in != -1)
+            TRY( close(in) );
+        if (!last)
+        {
+            TRY( close(p[1]) );
+            in = p[0];
+            cmd = ((struct pipecmd*) cmd)->right;
+        }
+    }
+    // Si no se pudo crear una tubería, las etapas ya lanzadas ven el fin de
+    // la entrada o `EPIPE` y terminan
+    if (started < n && in != -1)
+        TRY( close(in) );
+
+    for (int i = 0; i < started; i++)
+    {
+        int wstatus = wait_child(pids[i]);
+        if (i == n - 1)
+            status = wstatus;
+    }
+    free(pids);
+    return status;
 }
 
-void process_option(char * file, int size,int l,int maxLines,int b,int maxBytes)
-{   
-    int fd_read,fd_write;
-	if(!strcmp("stdin",file))
-        fd_read = STDIN_FILENO; //Si es la entrada estandar, ponemos que vamos a leerla
-	else
+
+// `run_tail` ejecuta `cmd` en un proceso hijo que ya no tiene nada más que
+// hacer después, por lo que nunca retorna. En lugar de crear otro hijo para
+// la última orden y esperarlo, el propio proceso la ejecuta con `exec`: así
+// `(a; b)`, `(cmd) &` o cada etapa de `a | b | c` no dejan una copia ociosa
+// del shell esperando. Una tubería es la excepción: este proceso tiene que
+// seguir vivo para recoger todas sus etapas.
+_Noreturn void run_tail(struct cmd* cmd)
+{
+    struct execcmd* ecmd;
+
+    for (;;)
     {
-    	if ((fd_read = open(file, O_RDONLY)) < 0) //Sino leeremos el fichero especificado
-    	{
-        	perror("open");
-        	exit(EXIT_FAILURE);
-    	}
-	}
-    char nombre[strlen(file)+12];
+        if (cmd == 0) exit(EXIT_SUCCESS);
 
-    int offset = 0;
-    int written = 0; int bytes_read = 0;
-    char buf[size];
-    int bytes_left = maxBytes;
-    int lines = maxLines;
-    int no_line = 0;
-    int num_psplit = 0;
-    int i,j;
-    int entrado = 0;
-    int empezado = 1;
-    while ((bytes_read = read(fd_read, buf,size))> 0)
-    {   
-        if(bytes_read == -1){
-            perror("read");
-            exit(EXIT_FAILURE);
-        }
-        i = 0;
-        offset = 0;
-	    //En caso de que hayamos puesto la opción de l
-        if(l) {
-	        //Mientras aún queden bytes leidos por escribir
-            while(bytes_read) 
-			{              
-                if((lines == maxLines && entrado) || empezado) /* Por si en la primera iteracion no se llega a escribir una linea entera,
-                                                                    asi evitamos que se creen archivos infinitos.*/
+        switch(cmd->type)
+        {
+            case EXEC:
+                ecmd = (struct execcmd*) cmd;
+                start_psubs(ecmd);
+                expand_argv(ecmd);
+                if (is_internal(ecmd->argv[0]))
                 {
-                    empezado =0;
-                    sprintf(nombre,"%s%d",file,num_psplit++);
-                    if ((fd_write = open(nombre, O_WRONLY | O_CREAT |O_TRUNC  ,S_IRWXU)) < 0)
-                    {   
-                        perror("open");
-                        exit(EXIT_FAILURE);
-                    } 
+                    g_status = 0;
+                    run_internal_exec(ecmd);
+                    fflush(stdout);
+                    wait_psubs(ecmd);
+                    exit(g_status);
                 }
-                /* Contamos el numero de lineas que vamos a escribir (restar a lineas restantes)*/
-                for(j=0;j < bytes_read && lines;j++){
-                    if(buf[offset+j]=='\n'){ // Contamos desde offset hasta offset+bytes_read
-                        entrado = 1;
-                        lines--;
-                    }
-                }
-                    // Escribimos
-                    int partial = 0;
-                    while((written = write(fd_write,buf+offset,j-partial))>0)
-					{
-                            offset+=written;
-                            bytes_read-=written;
-                            partial+=written;
-                            
+                exec_cmd(ecmd);
+                exit(EXIT_FAILURE);
 
-                    }
-                    if(written == -1){
-                        perror("write");
-                        exit(EXIT_FAILURE);
-                    }
-                    // Si no quedan lineas cerramos el archivo actual.
-                    if(lines == 0)
-				    {
-                        lines = maxLines; 
-                        TRY(fsync(fd_write));
-                        TRY( close(fd_write) );
-                    }
+            case REDR:
+                // Como en bash, las sustituciones de proceso se lanzan antes de
+                // aplicar las redirecciones de la orden
+                start_redr_psubs(cmd);
+                if ((cmd = apply_redrs(cmd, 0)) == NULL)
+                    exit(EXIT_FAILURE);
+                continue;
 
-                
-        
-            }
-   	
-        }else
-		{ 
-            while(bytes_read)
-            {
-            //Si los que quedan por colocar son el número maximo a tener
-                if(bytes_left == maxBytes)
-                {
-                    sprintf(nombre,"%s%d",file,num_psplit++);
-                    if ((fd_write = open(nombre, O_WRONLY | O_CREAT |O_TRUNC ,S_IRWXU)) < 0)
-                    {   
-                        perror("open");
-                        exit(EXIT_FAILURE);
-                    } 
-                }
-                //Mientras queden bytes por colocar y leer
-                while(bytes_left > 0 &&  bytes_read > 0)
-                {
-                    // ejemplo de querer escribir 2 bytes y leer 1 byte  
-					//Nos aseguramos de no escribir de más
-                    if(bytes_left >= bytes_read)
-					{
-                        i = bytes_read; //escribimos los maximos bytes posibles en cada iteracion
+            case LIST:
+                run_cmd(((struct listcmd*) cmd)->left);
+                cmd = ((struct listcmd*) cmd)->right;
+                continue;
+
+            case SUBS:
+                // Este proceso ya es el subshell
+                cmd = ((struct subscmd*) cmd)->cmd;
+                continue;
+
+            case PIPE:
+                set_status(run_pipeline((struct pipecmd*) cmd));
+                exit(g_status);
+
+            case BACK:
+                run_cmd(cmd);
+                exit(g_status);
+
+            case INV:
+            default:
+                panic("%s: estructura `cmd` desconocida\n", __func__);
+                exit(EXIT_FAILURE);
+        }
+    }
+}
+
+
+void run_cmd(struct cmd* cmd)
+{
+    struct execcmd* ecmd;
+    struct listcmd* lcmd;
+    struct pipecmd* pcmd;
+    struct backcmd* bcmd;
+    struct subscmd* scmd;
+
+    DPRINTF(DBG_TRACE, "STR\n");
+
+    if(cmd == 0) return;
+
+    switch(cmd->type)
+    {
+        case EXEC:
+            ecmd = (struct execcmd*) cmd;
+            start_psubs(ecmd);
+            expand_argv(ecmd);
+
+            if(is_internal(ecmd->argv[0])){
+                run_builtin(ecmd);
+            } 
+                
+            else{
+                pid_t pid;
+                if ((pid = fork_or_panic("fork EXEC")) == 0)
+                    exec_cmd(ecmd);
+                
+                close_psubs(ecmd);
+                set_status(wait_child(pid));
+            }
+            wait_psubs(ecmd);
+            free_argv(ecmd);
+
+
+            break;
+
+        case REDR:
+            /* Cuando se tiene que ejecutar un comando interno, 
+               no se debe crear un proceso hijo. 
+               No obstante, sí que se debe realizar la redirección.*/
+            struct cmd * inner = cmd;
+            while (inner->type == REDR)
+                inner = ((struct redrcmd *)inner)->cmd;
+            // Las sustituciones de proceso y los comodines se resuelven en
+            // el shell, antes de las redirecciones, como en `EXEC`
+            struct execcmd * iecmd = inner->type == EXEC ? (struct execcmd *)inner : NULL;
+            if (iecmd)
+            {
+                start_psubs(iecmd);
+                expand_argv(iecmd);
+            }
+            if(iecmd && is_internal(iecmd->argv[0])){
+                // Se guarda una copia de cada descriptor redirigido (que
+                // puede ser la entrada estándar del propio shell) para
+                // restaurarlo después
+                g_status = 1;
+                if (apply_redrs(cmd, 1) != NULL)
+                {
+                    run_builtin(iecmd);
+                    restore_redrs(cmd);
+                }
+            }else{
+                pid_t pid;
+                 if ((pid = fork_or_panic("fork REDR")) == 0)
+                    run_tail(cmd);
+                if (iecmd)
+                    close_psubs(iecmd);
+                set_status(wait_child(pid));
+            }
+            if (iecmd)
+            {
+                wait_psubs(iecmd);
+                free_argv(iecmd);
+            }
+           
+            break;
+
+        case LIST:
+            lcmd = (struct listcmd*) cmd;
+            run_cmd(lcmd->left);
+            run_cmd(lcmd->right);
+            break;
+
+        case PIPE:
+            pcmd = (struct pipecmd*)cmd;
+            set_status(run_pipeline(pcmd));
+
+            break;
+
+        case BACK:
+            bcmd = (struct backcmd*)cmd;
+            /* Solo el shell principal encola tareas: un hijo (subshell,
+               tubería...) termina al acabar su orden y no podría lanzar
+               después las tareas pendientes. */
+            g_status = 0;
+            if (getpid() == g_shell_pid && jobs_running() >= g_max_jobs)
+                enqueue_job(bcmd->cmd);
+            else
+                start_job(bcmd->cmd);
+            break;
+
+        case SUBS:
+            scmd = (struct subscmd*) cmd;
+            pid_t pids;
+	        if ((pids = fork_or_panic("fork SUBS")) == 0)
+                run_tail(scmd->cmd);
+            set_status(wait_child(pids));
+            break;
+
+        case INV:
+        default:
+            panic("%s: estructura `cmd` desconocida\n", __func__);
+    }
+
+    DPRINTF(DBG_TRACE, "END\n");
+}
+
+
+void print_cmd(struct cmd* cmd)
+{
+    struct execcmd* ecmd;
+    struct redrcmd* rcmd;
+    struct listcmd* lcmd;
+    struct pipecmd* pcmd;
+    struct backcmd* bcmd;
+    struct subscmd* scmd;
+
+    if(cmd == 0) return;
+
+    switch(cmd->type)
+    {
+        case EXEC:
+            ecmd = (struct execcmd*) cmd;
+            if (ecmd->argv[0] != 0)
+                printf("fork( exec( %s ) )", ecmd->argv[0]);
+            for (struct psubcmd* psub = ecmd->psubs; psub; psub = psub->next)
+            {
+                printf(" %c fork( ", psub->dir);
+                print_cmd(psub->cmd);
+                printf(" )");
+            }
+            break;
+
+        case REDR:
+            rcmd = (struct redrcmd*) cmd;
+            printf("fork( ");
+            if (rcmd->cmd->type == EXEC)
+                printf("exec ( %s )", ((struct execcmd*) rcmd->cmd)->argv[0]);
+            else
+                print_cmd(rcmd->cmd);
+            printf(" )");
+            break;
+
+        case LIST:
+            lcmd = (struct listcmd*) cmd;
+            print_cmd(lcmd->left);
+            printf(" ; ");
+            print_cmd(lcmd->right);
+            break;
+
+        case PIPE:
+            pcmd = (struct pipecmd*) cmd;
+            printf("fork( ");
+            if (pcmd->left->type == EXEC)
+                printf("exec ( %s )", ((struct execcmd*) pcmd->left)->argv[0]);
+            else
+                print_cmd(pcmd->left);
+            printf(" ) => fork( ");
+            if (pcmd->right->type == EXEC)
+                printf("exec ( %s )", ((struct execcmd*) pcmd->right)->argv[0]);
+            else
+                print_cmd(pcmd->right);
+            printf(" )");
+            break;
+
+        case BACK:
+            bcmd = (struct backcmd*) cmd;
+            printf("fork( ");
+            if (bcmd->cmd->type == EXEC)
+                printf("exec ( %s )", ((struct execcmd*) bcmd->cmd)->argv[0]);
+            else
+                print_cmd(bcmd->cmd);
+            printf(" )");
+            break;
+
+        case SUBS:
+            scmd = (struct subscmd*) cmd;
+            printf("fork( ");
+            print_cmd(scmd->cmd);
+            printf(" )");
+            break;
+
+        case INV:
+        default:
+            panic("%s: estructura `cmd` desconocida\n", __func__);
+    }
+}
+
+
+void free_cmd(struct cmd* cmd)
+{
+    struct execcmd* ecmd;
+    struct redrcmd* rcmd;
+    struct listcmd* lcmd;
+    struct pipecmd* pcmd;
+    struct backcmd* bcmd;
+    struct subscmd* scmd;
+
+    if(cmd == 0) return;
+
+    switch(cmd->type)
+    {
+        case EXEC:
+            ecmd = (struct execcmd*) cmd;
+            while (ecmd->psubs)
+            {
+                struct psubcmd* psub = ecmd->psubs;
+                ecmd->psubs = psub->next;
+                free_cmd(psub->cmd);
+                free(psub->cmd);
+                free(psub);
+            }
+            break;
+
+        case REDR:
+            rcmd = (struct redrcmd*) cmd;
+            free_cmd(rcmd->cmd);
+
+            free(rcmd->cmd);
+            free(rcmd->data);
+            break;
+
+        case LIST:
+            lcmd = (struct listcmd*) cmd;
+
+            free_cmd(lcmd->left);
+            free_cmd(lcmd->right);
+
+            free(lcmd->right);
+            free(lcmd->left);
+            break;
+
+        case PIPE:
+            pcmd = (struct pipecmd*) cmd;
+
+            free_cmd(pcmd->left);
+            free_cmd(pcmd->right);
+
+            free(pcmd->right);
+            free(pcmd->left);
+            break;
+
+        case BACK:
+            bcmd = (struct backcmd*) cmd;
+
+            free_cmd(bcmd->cmd);
+
+            free(bcmd->cmd);
+            break;
+
+        case SUBS:
+            scmd = (struct subscmd*) cmd;
+
+            free_cmd(scmd->cmd);
+
+            free(scmd->cmd);
+            break;
+
+        case INV:
+        default:
+            panic("%s: estructura `cmd` desconocida\n", __func__);
+    }
+}
+
+
+// `cmd_strings_size` devuelve el espacio necesario para copiar todas las
+// cadenas (terminadas en NULL) a las que apunta la estructura `cmd`.
+size_t cmd_strings_size(struct cmd* cmd)
+{
+    struct execcmd* ecmd;
+    struct redrcmd* rcmd;
+    struct listcmd* lcmd;
+    struct pipecmd* pcmd;
+    struct backcmd* bcmd;
+    struct subscmd* scmd;
+    size_t size = 0;
+
+    if(cmd == 0) return 0;
+
+    switch(cmd->type)
+    {
+        case EXEC:
+            ecmd = (struct execcmd*) cmd;
+            for (int i = 0; ecmd->argv[i]; i++)
+                size += strlen(ecmd->argv[i]) + 1;
+            for (struct psubcmd* psub = ecmd->psubs; psub; psub = psub->next)
+                size += cmd_strings_size(psub->cmd);
+            break;
+
+        case REDR:
+            rcmd = (struct redrcmd*) cmd;
+            size = strlen(rcmd->file) + 1 + cmd_strings_size(rcmd->cmd);
+            break;
+
+        case LIST:
+            lcmd = (struct listcmd*) cmd;
+            size = cmd_strings_size(lcmd->left) + cmd_strings_size(lcmd->right);
+            break;
+
+        case PIPE:
+            pcmd = (struct pipecmd*) cmd;
+            size = cmd_strings_size(pcmd->left) + cmd_strings_size(pcmd->right);
+            break;
+
+        case BACK:
+            bcmd = (struct backcmd*) cmd;
+            size = cmd_strings_size(bcmd->cmd);
+            break;
+
+        case SUBS:
+            scmd = (struct subscmd*) cmd;
+            size = cmd_strings_size(scmd->cmd);
+            break;
+
+        case INV:
+        default:
+            panic("%s: estructura `cmd` desconocida\n", __func__);
+    }
+
+    return size;
+}
+
+
+// Copia la cadena `str` en `*strings` y avanza `*strings` tras su terminador
+char* dup_string(const char* str, char** strings)
+{
+    char* copy = *strings;
+    size_t len = strlen(str);
+
+    memcpy(copy, str, len + 1);
+    *strings += len + 1;
+
+    return copy;
+}
+
+
+// `dup_cmd` realiza una copia profunda de una estructura `cmd` ya terminada
+// en NULL. Las cadenas se copian de forma consecutiva en `*strings`, que debe
+// tener al menos `cmd_strings_size(cmd)` bytes. La copia se libera con
+// `free_cmd` y `free`, como las estructuras construidas por `parse_cmd`.
+struct cmd* dup_cmd(struct cmd* cmd, char** strings)
+{
+    struct execcmd* ecmd;
+    struct redrcmd* rcmd;
+    struct listcmd* lcmd;
+    struct pipecmd* pcmd;
+    struct backcmd* bcmd;
+    struct subscmd* scmd;
+    struct cmd* ret = 0;
+
+    if(cmd == 0) return 0;
+
+    switch(cmd->type)
+    {
+        case EXEC:
+            ecmd = (struct execcmd*) execcmd();
+            *ecmd = *(struct execcmd*) cmd;
+            ecmd->argv = ecmd->words;
+            for (int i = 0; ecmd->argv[i]; i++)
+            {
+                ecmd->argv[i] = dup_string(ecmd->argv[i], strings);
+                ecmd->eargv[i] = ecmd->argv[i] + strlen(ecmd->argv[i]);
+            }
+            // Los argumentos de las sustituciones de proceso apuntan a la
+            // ruta de la copia
+            for (struct psubcmd** psub = &ecmd->psubs; *psub; psub = &(*psub)->next)
+            {
+                struct psubcmd* copy = (struct psubcmd*)
+                    psubcmd(dup_cmd((*psub)->cmd, strings), (*psub)->dir);
+                copy->argi = (*psub)->argi;
+                copy->next = (*psub)->next;
+                ecmd->argv[copy->argi] = ecmd->eargv[copy->argi] = copy->path;
+                *psub = copy;
+            }
+            ret = (struct cmd*) ecmd;
+            break;
+
+        case REDR:
+            rcmd = (struct redrcmd*) cmd;
+            ret = redrcmd(dup_cmd(rcmd->cmd, strings),
+                    NULL, NULL, rcmd->flags, rcmd->mode, rcmd->fd);
+            ((struct redrcmd*) ret)->file = dup_string(rcmd->file, strings);
+            ((struct redrcmd*) ret)->efile = ((struct redrcmd*) ret)->file
+                + strlen(rcmd->file);
+            ((struct redrcmd*) ret)->kind = rcmd->kind;
+            if (rcmd->data && !(((struct redrcmd*) ret)->data = strdup(rcmd->data)))
+            {
+                perror("dup_cmd: strdup");
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case LIST:
+            lcmd = (struct listcmd*) cmd;
+            ret = dup_cmd(lcmd->left, strings);
+            ret = listcmd(ret, dup_cmd(lcmd->right, strings));
+            break;
+
+        case PIPE:
+            pcmd = (struct pipecmd*) cmd;
+            ret = dup_cmd(pcmd->left, strings);
+            ret = pipecmd(ret, dup_cmd(pcmd->right, strings));
+            break;
+
+        case BACK:
+            bcmd = (struct backcmd*) cmd;
+            ret = backcmd(dup_cmd(bcmd->cmd, strings));
+            break;
+
+        case SUBS:
+            scmd = (struct subscmd*) cmd;
+            ret = subscmd(dup_cmd(scmd->cmd, strings));
+            break;
+
+        case INV:
+        default:
+            panic("%s: estructura `cmd` desconocida\n", __func__);
+    }
+
+    return ret;
+}
+
+
+/******************************************************************************
+ * Gestión de procesos hijo: bucle de eventos
+ ******************************************************************************/
+
+
+// SIGCHLD permanece bloqueada en el shell y se recibe a través de un
+// `signalfd`, que se vigila con `epoll` junto con la entrada estándar. Así,
+// todos los hijos (en primer y segundo plano) se recogen con `waitpid` desde
+// un único punto, fuera de cualquier manejador de señal.
+//
+// Los procesos hijo del shell que ejecutan a su vez órdenes (subshells,
+// tuberías...) heredan la máscara pero no el bucle: `loop_init` lo vuelve a
+// crear si detecta que se ejecuta en un proceso distinto.
+
+#define MAX_EVENTS 8
+#define FD_INTERNAL 64
+#define MIN_REAPED 64
+
+int g_sigfd = -1;
+int g_epfd = -1;
+pid_t g_loop_pid = -1;
+int g_stdin_polled = 0;     // La entrada estándar está registrada en `epoll`
+int g_stdin_pollable = 1;   // `epoll` no admite ficheros regulares
+
+// Hijos en primer plano recogidos mientras se esperaba a otro hijo, en el
+// orden en que terminaron. Ningún estado se descarta: alguien puede estar
+// esperándolo con `wait_child`, así que el búfer crece cuanto haga falta.
+struct reaped {
+    pid_t pid;
+    int status;
+};
+struct reaped* reaped = NULL;
+int num_reaped = 0;
+int max_reaped = 0;
+
+// Línea leída por `readline` en modo *callback*
+char* g_line;
+int g_line_ready;
+int g_reading_line = 0;
+
+
+void dispatch_jobs();
+
+
+// Descarta el bucle de eventos heredado del proceso padre
+void loop_reset()
+{
+    if (g_sigfd != -1)
+        TRY( close(g_sigfd) );
+    if (g_epfd != -1)
+        TRY( close(g_epfd) );
+    g_sigfd = g_epfd = -1;
+    g_loop_pid = -1;
+    g_stdin_polled = 0;
+    num_reaped = 0;
+}
+
+
+// Mueve el descriptor `fd` por encima de `FD_INTERNAL` para que las
+// redirecciones de las órdenes internas (`3>fichero`...) no lo pisen
+int fd_internal(int fd)
+{
+    int high;
+
+    TRY( high = fcntl(fd, F_DUPFD_CLOEXEC, FD_INTERNAL) );
+    TRY( close(fd) );
+    return high;
+}
+
+
+// Crea el `signalfd` y la instancia de `epoll` del proceso actual
+void loop_init()
+{
+    struct epoll_event ev;
+
+    if (g_loop_pid == getpid())
+        return;
+    loop_reset();
+
+    TRY( g_sigfd = signalfd(-1, &g_sigchld_mask, SFD_NONBLOCK | SFD_CLOEXEC) );
+    g_sigfd = fd_internal(g_sigfd);
+    TRY( g_epfd = epoll_create1(EPOLL_CLOEXEC) );
+    g_epfd = fd_internal(g_epfd);
+    ev.events = EPOLLIN;
+    ev.data.fd = g_sigfd;
+    TRY( epoll_ctl(g_epfd, EPOLL_CTL_ADD, g_sigfd, &ev) );
+    g_loop_pid = getpid();
+}
+
+
+// Anota el final de una tarea en segundo plano. Devuelve 0 si `pid` no es
+// una tarea en segundo plano.
+int finish_job(pid_t pid)
+{
+    for (int i = 0; i < MAX_PIDS; i++)
+    {
+        if (processes[i] == pid)
+        {
+            processes[i] = -1;
+            if (g_bench)
+                return 1;
+            // Si se estaba leyendo una línea, el aviso va en una línea propia
+            // y a continuación se redibuja el *prompt*
+            printf(g_reading_line ? "\n[%d]\n" : "[%d]\n", pid);
+            fflush(stdout);
+            if (g_reading_line)
+            {
+                rl_on_new_line();
+                rl_redisplay();
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// Recoge todos los hijos terminados. Las tareas en segundo plano se dan por
+// finalizadas y el resto se guarda en `reaped` hasta que se esperen.
+void reap_children()
+{
+    struct signalfd_siginfo si;
+    pid_t pid;
+    int status, done = 0;
+
+    // Vacía el `signalfd`: varias SIGCHLD pueden fusionarse en una
+    while (read(g_sigfd, &si, sizeof(si)) == sizeof(si))
+        ;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        if (finish_job(pid))
+        {
+            done = 1;
+            continue;
+        }
+        if (num_reaped == max_reaped)
+        {
+            max_reaped = max_reaped ? max_reaped * 2 : MIN_REAPED;
+            if ((reaped = realloc(reaped, max_reaped * sizeof(reaped[0]))) == NULL)
+            {
+                perror("reap_children: realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        reaped[num_reaped].pid = pid;
+        reaped[num_reaped].status = status;
+        num_reaped++;
+    }
+
+    // Los huecos liberados se ocupan con tareas de la cola
+    if (done && job_queue && getpid() == g_shell_pid)
+        dispatch_jobs();
+}
+
+
+// Espera a que se produzca algún evento y lo atiende. Devuelve 1 si la
+// entrada estándar tiene datos.
+int wait_event(int want_stdin)
+{
+    struct epoll_event ev[MAX_EVENTS];
+    int n, input = 0;
+
+    if (want_stdin && !g_stdin_polled && g_stdin_pollable)
+    {
+        struct epoll_event in = { .events = EPOLLIN, .data.fd = STDIN_FILENO };
+        if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, STDIN_FILENO, &in) == 0)
+            g_stdin_polled = 1;
+        else if (errno == EPERM)
+            g_stdin_pollable = 0;
+        else
+            TRY( -1 );
+    }
+
+    // Un fichero regular siempre está listo para leer
+    if (want_stdin && !g_stdin_pollable)
+    {
+        reap_children();
+        return 1;
+    }
+
+    while ((n = epoll_wait(g_epfd, ev, MAX_EVENTS, -1)) < 0 && errno == EINTR)
+        ;
+    TRY( n );
+
+    for (int i = 0; i < n; i++)
+    {
+        if (ev[i].data.fd == g_sigfd)
+            reap_children();
+        else if (ev[i].data.fd == STDIN_FILENO && want_stdin)
+            input = 1;
+    }
+
+    return input;
+}
+
+
+// Si el hijo `pid` ya se ha recogido, lo saca de `reaped`, deja su estado en
+// `status` y devuelve 1
+int take_reaped(pid_t pid, int* status)
+{
+    for (int i = 0; i < num_reaped; i++)
+    {
+        if (reaped[i].pid == pid)
+        {
+            *status = reaped[i].status;
+            memmove(reaped + i, reaped + i + 1, (--num_reaped - i) * sizeof(reaped[0]));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// `wait_child` espera a que termine el hijo `pid` atendiendo mientras tanto
+// al resto de hijos y devuelve su estado de terminación.
+int wait_child(pid_t pid)
+{
+    int status;
+
+    loop_init();
+
+    for (;;)
+    {
+        reap_children();
+        if (take_reaped(pid, &status))
+            return status;
+        wait_event(0);
+    }
+}
+
+
+void line_handler(char* line)
+{
+    rl_callback_handler_remove();
+    g_line = line;
+    g_line_ready = 1;
+}
+
+
+// `read_plain_line` lee una línea de una entrada no interactiva sin
+// readline, que nunca llega a inicializarse. Si la entrada es un fichero
+// regular se lee por bloques y se devuelve con `lseek` lo leído de más, para
+// que las órdenes que lean de la entrada estándar continúen justo después
+// de la línea; en otro caso (tuberías) no se puede devolver, y se lee byte a
+// byte como hace readline.
+char* read_plain_line()
+{
+    static int seekable = -1;
+    static int avail = 0;       // Bytes que se sabe que hay en la tubería
+    char chunk[BSIZE * 16];
+    char* line = NULL;
+    size_t len = 0, cap = 0;
+    ssize_t n;
+
+    if (seekable < 0)
+    {
+        struct stat st;
+        seekable = fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode) &&
+            lseek(STDIN_FILENO, 0, SEEK_CUR) >= 0;
+    }
+
+    startup_report();
+
+    for (;;)
+    {
+        // Se sigue atendiendo a los hijos mientras no hay datos. En una
+        // tubería, `FIONREAD` dice cuántos bytes se pueden leer sin esperar.
+        if (avail <= 0)
+        {
+            if (!wait_event(1))
+                continue;
+            if (seekable || ioctl(STDIN_FILENO, FIONREAD, &avail) < 0)
+                avail = 0;
+        }
+        if ((n = read(STDIN_FILENO, chunk, seekable ? sizeof(chunk) : 1)) < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            perror("read_plain_line: read");
+            n = 0;
+        }
+        if (n == 0)
+            break;
+        avail -= n;
+
+        char* nl = memchr(chunk, '\n', n);
+        size_t take = nl ? (size_t) (nl - chunk) : (size_t) n;
+        if (len + take + 1 > cap)
+        {
+            cap = (len + take + 1) * 2;
+            if ((line = realloc(line, cap)) == NULL)
+            {
+                perror("read_plain_line: realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        memcpy(line + len, chunk, take);
+        len += take;
+        line[len] = 0;
+
+        if (nl)
+        {
+            if (nl + 1 < chunk + n)
+                TRY( lseek(STDIN_FILENO, (nl + 1) - (chunk + n), SEEK_CUR) );
+            return line;
+        }
+    }
+
+    // Fin de fichero: la última línea puede no terminar en `\n`
+    if (len == 0)
+    {
+        free(line);
+        return NULL;
+    }
+    return line;
+}
+
+
+// `read_line` lee una línea con la interfaz *callback* de `readline`, de
+// modo que el shell sigue recogiendo hijos y lanzando tareas de la cola
+// mientras espera a que el usuario escriba.
+char* read_line(const char* prompt)
+{
+    loop_init();
+
+    if (!g_interactive)
+        return read_plain_line();
+
+    g_line = NULL;
+    g_line_ready = 0;
+    g_reading_line = 1;
+    rl_callback_handler_install(prompt, line_handler);
+    startup_mark("readline");
+    startup_report();
+    while (!g_line_ready)
+        if (wait_event(1))
+            rl_callback_read_char();
+    g_reading_line = 0;
+
+    return g_line;
+}
+
+
+/******************************************************************************
+ * Lectura de la línea de órdenes con la biblioteca libreadline
+ ******************************************************************************/
+
+
+// El *prompt* se construye a partir del formato de la variable de entorno
+// `SIMPLESH_PROMPT` (por defecto `%u@%w> `, como hasta ahora):
+//
+//     %u  usuario            %w  nombre del directorio actual
+//     %d  directorio actual  %h  nombre de la máquina
+//     %g  rama de git        %l  carga media del último minuto
+//     %%  el carácter `%`
+//
+// El usuario y la máquina se resuelven una sola vez (`getpwuid` puede pasar
+// por NSS o LDAP) y el directorio actual lo mantiene `run_cd`, de modo que
+// mostrar el *prompt* no hace llamadas al sistema mientras nada cambia. Los
+// campos caros (`%g` y `%l`) solo se calculan si el formato los usa y se
+// guardan `PROMPT_TTL` segundos; el texto se reconstruye únicamente cuando
+// cambia el formato, el directorio o alguno de esos campos caduca.
+
+#define DEFAULT_PROMPT "%u@%w> "
+#define PROMPT_TTL 2
+#define PROMPT_MAX (PATH_MAX + 256)
+
+char g_user[LOGIN_NAME_MAX + 1];
+char g_host[HOST_NAME_MAX + 1];
+char g_cwd[PATH_MAX];
+int g_cwd_valid = 0;
+
+struct prompt_cache {
+    char format[256];       // Formato con el que se construyó `text`
+    char text[PROMPT_MAX];
+    int dirty;              // Hay que reconstruir `text`
+    time_t expires;         // Caducidad de los campos caros (0: no hay)
+    char branch[NAME_MAX + 1];
+    time_t branch_expires;
+    char load[16];
+    time_t load_expires;
+};
+
+struct prompt_cache g_prompt = { .dirty = 1 };
+
+
+// Segundos de un reloj monótono que se lee sin llamada al sistema (vDSO)
+time_t coarse_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+
+// `shell_user` devuelve el nombre del usuario, que se resuelve una sola vez
+const char* shell_user()
+{
+    if (!g_user[0])
+    {
+        struct passwd* passwd = getpwuid(getuid());
+        if (!passwd)
+        {
+            perror("getpwuid");
+            exit(EXIT_FAILURE);
+        }
+        snprintf(g_user, sizeof(g_user), "%s", passwd->pw_name);
+    }
+    return g_user;
+}
+
+
+// `shell_cwd` devuelve el directorio actual del shell. Solo se consulta al
+// sistema la primera vez y después de cada `cd`.
+const char* shell_cwd()
+{
+    if (!g_cwd_valid)
+    {
+        if (!getcwd(g_cwd, sizeof(g_cwd)))
+        {
+            perror("getcwd");
+            exit(EXIT_FAILURE);
+        }
+        g_cwd_valid = 1;
+    }
+    return g_cwd;
+}
+
+
+// `cwd_changed` anota que el directorio actual ha cambiado
+void cwd_changed()
+{
+    g_cwd_valid = 0;
+    g_prompt.dirty = 1;
+    g_prompt.branch_expires = 0;
+}
+
+
+// Guarda en `branch` la rama de git del repositorio que contiene el
+// directorio actual (o el principio del *commit* si no hay rama), o la cadena
+// vacía si no está en ninguno
+void git_branch(char* branch, size_t size)
+{
+    char path[PATH_MAX + 16];
+    char head[PATH_MAX];
+    size_t len;
+    ssize_t n;
+    int fd = -1;
+
+    branch[0] = 0;
+    snprintf(path, sizeof(path), "%s", shell_cwd());
+
+    // Busca `.git/HEAD` hacia la raíz
+    for (len = strlen(path); ; )
+    {
+        snprintf(path + len, sizeof(path) - len, "/.git/HEAD");
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0)
+            break;
+
+        // `.git` puede ser un fichero (`gitdir: RUTA`) en los *worktrees*
+        path[len + 5] = 0;
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0)
+        {
+            n = read(fd, head, sizeof(head) - 1);
+            TRY( close(fd) );
+            fd = -1;
+            if (n > 8 && !strncmp(head, "gitdir: ", 8))
+            {
+                head[n] = 0;
+                head[strcspn(head, "\n")] = 0;
+                if (head[8] == '/')
+                    snprintf(path, sizeof(path), "%s/HEAD", head + 8);
+                else
+                    snprintf(path + len + 1, sizeof(path) - len - 1, "%s/HEAD", head + 8);
+                fd = open(path, O_RDONLY | O_CLOEXEC);
+            }
+            break;
+        }
+
+        path[len] = 0;
+        if (len <= 1)
+            return;
+        while (len > 0 && path[len] != '/')
+            len--;
+        if (len == 0)
+            len = 1;
+        path[len] = 0;
+        if (len == 1)
+            len = 0;
+    }
+    if (fd < 0)
+        return;
+
+    n = read(fd, head, sizeof(head) - 1);
+    TRY( close(fd) );
+    if (n <= 0)
+        return;
+    head[n] = 0;
+    head[strcspn(head, "\n")] = 0;
+
+    if (!strncmp(head, "ref: refs/heads/", 16))
+        snprintf(branch, size, "%s", head + 16);
+    else
+        snprintf(branch, size, "%.7s", head);
+}
+
+
+// `build_prompt` devuelve el *prompt*, reconstruyéndolo solo si hace falta
+const char* build_prompt()
+{
+    const char* format = getenv("SIMPLESH_PROMPT");
+    time_t now = 0;
+    char* out = g_prompt.text;
+    char* end = g_prompt.text + sizeof(g_prompt.text) - 1;
+
+    if (!format)
+        format = DEFAULT_PROMPT;
+    if (strcmp(format, g_prompt.format))
+    {
+        snprintf(g_prompt.format, sizeof(g_prompt.format), "%s", format);
+        g_prompt.dirty = 1;
+    }
+    if (g_prompt.expires && (now = coarse_now()) >= g_prompt.expires)
+        g_prompt.dirty = 1;
+    if (!g_prompt.dirty)
+        return g_prompt.text;
+
+    g_prompt.expires = 0;
+    for (const char* f = g_prompt.format; *f && out < end; f++)
+    {
+        const char* field = NULL;
+
+        if (*f != '%' || !f[1])
+        {
+            *out++ = *f;
+            continue;
+        }
+        switch (*++f)
+        {
+            case 'u':
+                field = shell_user();
+                break;
+            case 'd':
+                field = shell_cwd();
+                break;
+            case 'w':
+                field = strrchr(shell_cwd(), '/');
+                field = field[1] ? field + 1 : field;
+                break;
+            case 'h':
+                if (!g_host[0] && gethostname(g_host, sizeof(g_host) - 1) < 0)
+                    strcpy(g_host, "?");
+                field = g_host;
+                break;
+            case 'g':
+                if (!now)
+                    now = coarse_now();
+                if (now >= g_prompt.branch_expires)
+                {
+                    git_branch(g_prompt.branch, sizeof(g_prompt.branch));
+                    g_prompt.branch_expires = now + PROMPT_TTL;
+                }
+                if (!g_prompt.expires || g_prompt.branch_expires < g_prompt.expires)
+                    g_prompt.expires = g_prompt.branch_expires;
+                field = g_prompt.branch;
+                break;
+            case 'l':
+                if (!now)
+                    now = coarse_now();
+                if (now >= g_prompt.load_expires)
+                {
+                    double load;
+                    if (getloadavg(&load, 1) == 1)
+                        snprintf(g_prompt.load, sizeof(g_prompt.load), "%.2f", load);
+                    else
+                        strcpy(g_prompt.load, "?");
+                    g_prompt.load_expires = now + PROMPT_TTL;
+                }
+                if (!g_prompt.expires || g_prompt.load_expires < g_prompt.expires)
+                    g_prompt.expires = g_prompt.load_expires;
+                field = g_prompt.load;
+                break;
+            case '%':
+                field = "%";
+                break;
+            default:
+                // Secuencia desconocida: se muestra tal cual
+                *out++ = '%';
+                if (out < end)
+                    *out++ = *f;
+                break;
+        }
+        while (field && *field && out < end)
+            *out++ = *field++;
+    }
+    *out = 0;
+    g_prompt.dirty = 0;
+
+    return g_prompt.text;
+}
+
+
+// `get_cmd` muestra un *prompt* y lee lo que el usuario escribe usando la
+// biblioteca readline. Ésta permite mantener el historial, utilizar las flechas
+// para acceder a las órdenes previas del historial, búsquedas de órdenes, etc.
+
+char* get_cmd()
+{
+    // Sin terminal no hay *prompt* ni historial de readline
+    if (!g_interactive)
+        return read_line(NULL);
+
+    // Lee la orden tecleada por el usuario
+    char * buf = read_line(build_prompt());
+
+    
+  
+    // Si el usuario ha escrito una orden, almacenarla en la historia.
+    if(buf)
+        add_history(buf);
+
+    return buf;
+}
+
+// `read_heredocs` lee de la entrada, en el orden en el que aparecen en la
+// línea de órdenes, el contenido de los here-documents de `cmd`: las líneas
+// siguientes hasta la que contiene solo el delimitador.
+void read_heredocs(struct cmd* cmd)
+{
+    struct redrcmd* rcmd;
+    char* line;
+    size_t len, size;
+
+    if (cmd == 0) return;
+
+    switch (cmd->type)
+    {
+        case EXEC:
+            for (struct psubcmd* psub = ((struct execcmd*) cmd)->psubs; psub; psub = psub->next)
+                read_heredocs(psub->cmd);
+            break;
+
+        case REDR:
+            rcmd = (struct redrcmd*) cmd;
+            read_heredocs(rcmd->cmd);
+            if (rcmd->kind != REDR_HEREDOC)
+                break;
+
+            len = 0;
+            size = BSIZE;
+            if ((rcmd->data = malloc(size)) == NULL)
+            {
+                perror("read_heredocs: malloc");
+                exit(EXIT_FAILURE);
+            }
+            rcmd->data[0] = 0;
+            while ((line = read_line("> ")) != NULL && strcmp(line, rcmd->file))
+            {
+                size_t n = strlen(line);
+                while (len + n + 2 > size)
+                    if ((rcmd->data = realloc(rcmd->data, size *= 2)) == NULL)
+                    {
+                        perror("read_heredocs: realloc");
+                        exit(EXIT_FAILURE);
+                    }
+                memcpy(rcmd->data + len, line, n);
+                len += n;
+                rcmd->data[len++] = '\n';
+                rcmd->data[len] = 0;
+                free(line);
+            }
+            if (line == NULL)
+                error("%s: fin de fichero antes del delimitador '%s'\n", __func__, rcmd->file);
+            free(line);
+            break;
+
+        case LIST:
+            read_heredocs(((struct listcmd*) cmd)->left);
+            read_heredocs(((struct listcmd*) cmd)->right);
+            break;
+
+        case PIPE:
+            read_heredocs(((struct pipecmd*) cmd)->left);
+            read_heredocs(((struct pipecmd*) cmd)->right);
+            break;
+
+        case BACK:
+            read_heredocs(((struct backcmd*) cmd)->cmd);
+            break;
+
+        case SUBS:
+            read_heredocs(((struct subscmd*) cmd)->cmd);
+            break;
+
+        case INV:
+        default:
+            panic("%s: estructura `cmd` desconocida\n", __func__);
+    }
+}
+
+
+// Devuelve 1 si `cmd` contiene algún here-document
+int has_heredoc(struct cmd* cmd)
+{
+    if (cmd == 0) return 0;
+
+    switch (cmd->type)
+    {
+        case EXEC:
+            for (struct psubcmd* psub = ((struct execcmd*) cmd)->psubs; psub; psub = psub->next)
+                if (has_heredoc(psub->cmd))
+                    return 1;
+            return 0;
+        case REDR:
+            return ((struct redrcmd*) cmd)->kind == REDR_HEREDOC ||
+                has_heredoc(((struct redrcmd*) cmd)->cmd);
+        case LIST:
+            return has_heredoc(((struct listcmd*) cmd)->left) ||
+                has_heredoc(((struct listcmd*) cmd)->right);
+        case PIPE:
+            return has_heredoc(((struct pipecmd*) cmd)->left) ||
+                has_heredoc(((struct pipecmd*) cmd)->right);
+        case BACK:
+            return has_heredoc(((struct backcmd*) cmd)->cmd);
+        case SUBS:
+            return has_heredoc(((struct subscmd*) cmd)->cmd);
+        default:
+            return 0;
+    }
+}
+
+
+void insert_process(pid_t pid){
+    
+    for(int i = 0;i < MAX_PIDS; i++ ) {
+        if(processes[i] == -1){
+            processes[i] = pid;
+            clock_gettime(CLOCK_MONOTONIC,&processes_start[i]);
+            break;
+        }
+    }
+}
+
+
+// Devuelve el número de tareas en segundo plano en ejecución
+int jobs_running()
+{
+    int n = 0;
+
+    for (int i = 0; i < MAX_PIDS; i++)
+        if (processes[i] != -1)
+            n++;
+    return n;
+}
+
+
+// Lanza en segundo plano la orden `cmd` y la registra en `processes`
+void start_job(struct cmd* cmd)
+{
+    pid_t pid;
+
+    // El PID se registra antes de que el bucle de eventos pueda recogerlo
+    if ((pid = fork_or_panic("fork BACK")) == 0)
+    {
+        apply_prio_class(0, &g_bg_class);
+        run_tail(cmd);
+    }
+
+    // La siguiente tarea empieza sus tuberías en otra LLC
+    g_place_next++;
+    insert_process(pid);
+    if (g_bench)
+        return;
+    printf("[%d]\n",pid); // Indicamos que empieza el proceso con su [PID]
+    fflush(stdout);
+}
+
+
+// Encola una copia de `cmd` hasta que haya un hueco para ejecutarla
+void enqueue_job(struct cmd* cmd)
+{
+    struct job* job;
+    struct job** last;
+    char* strings;
+
+    if ((job = malloc(sizeof(*job))) == NULL)
+    {
+        perror("enqueue_job: malloc");
+        exit(EXIT_FAILURE);
+    }
+    if ((job->strings = malloc(cmd_strings_size(cmd) + 1)) == NULL)
+    {
+        perror("enqueue_job: malloc");
+        exit(EXIT_FAILURE);
+    }
+    strings = job->strings;
+    job->cmd = dup_cmd(cmd, &strings);
+    job->id = g_next_job_id++;
+    job->prio = g_job_prio;
+    job->next = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &job->queued);
+
+    for (last = &job_queue; *last; last = &(*last)->next)
+        ;
+    *last = job;
+
+    printf("[en cola #%d]\n", job->id);
+    fflush(stdout);
+}
+
+
+// Extrae de la cola la siguiente tarea según la política activa
+struct job* dequeue_job()
+{
+    struct job** best = &job_queue;
+    struct job* job;
+
+    if (!job_queue)
+        return NULL;
+
+    if (g_job_policy == JOB_PRIO)
+        for (struct job** j = &job_queue; *j; j = &(*j)->next)
+            if ((*j)->prio > (*best)->prio)
+                best = j;
+
+    job = *best;
+    *best = job->next;
+    return job;
+}
+
+
+// Libera una tarea extraída de la cola
+void free_job(struct job* job)
+{
+    free_cmd(job->cmd);
+    free(job->cmd);
+    free(job->strings);
+    free(job);
+}
+
+
+// Lanza tareas de la cola mientras haya huecos libres. Se llama desde el bucle
+// de eventos en cuanto se recoge una tarea terminada.
+void dispatch_jobs()
+{
+    struct job* job;
+
+    while (jobs_running() < g_max_jobs && (job = dequeue_job()) != NULL)
+    {
+        start_job(job->cmd);
+        free_job(job);
+    }
+}
+
+
+// Descarta, avisando de cada una, las tareas que siguen en la cola cuando el
+// shell termina
+void discard_jobs()
+{
+    struct job* job;
+
+    // Un subshell que ejecuta `exit` solo tiene una copia de la cola
+    if (getpid() != g_shell_pid)
+        return;
+    while ((job = dequeue_job()) != NULL)
+    {
+        printf("[#%d descartada]\n", job->id);
+        free_job(job);
+    }
+    fflush(stdout);
+}
+
+
+// Segundos transcurridos desde `since`
+double elapsed_since(struct timespec* since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+
+void run_cwd()
+{
+    printf("cwd: %s\n", shell_cwd());
+}
+
+void run_exit(struct cmd * ecmd) 
+{		
+    discard_jobs();
+	free_cmd(ecmd);
+	free(ecmd);
+	exit(EXIT_SUCCESS);
+}
+
+void run_cd(struct execcmd * cmd) 
+{	
+    static int num_cd = 0; // Para mantener estado entre llamadas
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s", shell_cwd());
+    /* Si es el primer cd que se realiza en el shell 
+       y trata de realizar cd - se lanzara un mensaje de error y 
+       no se aumentará el numero de cd realizados*/
+	char * arg1 = cmd->argv[1];
+	if(!num_cd) {
+		setenv("OLDPWD",path,1);	
+		if(arg1 == NULL) {
+			TRY(chdir(getenv("HOME"))); 
+		    num_cd++;
+        }else if(!strcmp(arg1,"-")){
+			printf("run_cd: Variable OLDPWD no definida\n");
+		}else if(cmd->argv[2] != NULL) {
+			printf("run_cd: Demasiados argumentos\n");
+		}else {
+			
+			if(chdir(arg1) == -1)
+				printf("run_cd: No existe el directorio '%s'\n",arg1);
+            num_cd++;	
+		}	
+	} else {
+		if(arg1 == NULL) {
+			TRY(chdir(getenv("HOME")));
+		}else if(!strcmp(arg1,"-")){
+			TRY(chdir(getenv("OLDPWD")));
+		}else if(cmd->argv[2] != NULL) {
+			printf("run_cd: Demasiados argumentos\n");
+		}else {
+
+			if(chdir(arg1) == -1){
+			    printf("run_cd: No existe el directorio '%s'\n",arg1);
+            }
+		}
+		TRY(setenv("OLDPWD",path,1));
+        num_cd++;
+	}
+    // El directorio actual (y el *prompt*) se recalculan solo tras un `cd`
+    cwd_changed();
+}
+
+// Nombres de los trozos de `psplit`
+//
+// Por defecto cada trozo se llama como la entrada seguida de su número
+// (`fichero0`, `fichero1`...). Con `-t` el nombre sale de una plantilla al
+// estilo de printf: `%s` es el nombre de la entrada, `%d` (con anchura y
+// ceros opcionales, p. ej. `%05d`) el número del trozo y `%%` un `%`. Con
+// `-d` los trozos se crean en otro directorio y `%s` es solo el nombre base
+// de la entrada.
+//
+// Un directorio con cientos de miles de entradas hace lentas las búsquedas y
+// los listados, así que cuando una entrada supera `-S` trozos (4096 por
+// defecto) estos se reparten en 256 subdirectorios `00`...`ff` según un hash
+// de su nombre; los que ya se habían creado se mueven con `renameat`, de modo
+// que todos los trozos de una entrada quedan siempre igual organizados. Los
+// trozos se abren con `openat` sobre los descriptores de los directorios, que
+// se abren una sola vez, en lugar de resolver la ruta completa cada vez.
+
+#define PSPLIT_SHARD_AFTER 4096
+#define PSPLIT_SHARDS 256
+
+struct psplit_output {
+    const char* dir;        // Directorio de salida o NULL
+    const char* tmpl;       // Plantilla o NULL
+    int shard_after;        // Trozos antes de repartir (0: nunca)
+    int manifest;           // Escribe el manifiesto (`-m`)
+};
+
+// Entrada del manifiesto de un trozo
+struct chunk_rec {
+    long long offset;       // Posición en la entrada
+    long long length;
+    long long lines;
+    uint32_t crc;           // CRC32C del contenido
+};
+
+struct chunk_out {
+    const struct psplit_output* opts;
+    const char* base;               // Valor de `%s`
+    int dirfd;
+    int fd;                         // Trozo abierto o -1
+    int count;                      // Trozos creados
+    int sharded;
+    int shard_fd[PSPLIT_SHARDS];    // -1 hasta usarlo
+    long long pos;                  // Bytes de la entrada ya escritos
+    struct chunk_rec* recs;         // Con `-m`, uno por trozo
+    int cap;                        // 0 si `recs` es memoria compartida
+};
+
+
+// CRC32C (polinomio de Castagnoli, el de iSCSI, ext4 y Btrfs). En x86-64 con
+// SSE4.2 se usa la instrucción `crc32`, que procesa 8 bytes por instrucción;
+// si no, una tabla de 256 entradas. Ambas dan el mismo resultado.
+
+#define CRC32C_POLY 0x82f63b78
+
+uint32_t crc32c_table[256];
+
+
+uint32_t crc32c_sw(uint32_t crc, const unsigned char* p, size_t len)
+{
+    if (crc32c_table[1] == 0)
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+            crc32c_table[i] = c;
+        }
+
+    while (len--)
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t len)
+{
+    unsigned long long c = crc;
+
+    for (; len > 0 && ((uintptr_t) p & 7); len--)
+        c = __builtin_ia32_crc32qi(c, *p++);
+    for (; len >= 8; len -= 8, p += 8)
+    {
+        unsigned long long word;
+        memcpy(&word, p, 8);
+        c = __builtin_ia32_crc32di(c, word);
+    }
+    for (; len > 0; len--)
+        c = __builtin_ia32_crc32qi(c, *p++);
+    return c;
+}
+#endif
+
+
+// Continúa el CRC32C `crc` (0 para empezar) con `len` bytes de `data`
+uint32_t crc32c(uint32_t crc, const void* data, size_t len)
+{
+#if defined(__x86_64__)
+    static int hw = -1;
+
+    if (hw < 0)
+        hw = __builtin_cpu_supports("sse4.2");
+    if (hw)
+        return ~crc32c_hw(~crc, data, len);
+#endif
+    return ~crc32c_sw(~crc, data, len);
+}
+
+
+// Comprueba que `tmpl` es una plantilla válida: exactamente un `%d`, como
+// mucho un `%s` y sin `/`
+int check_chunk_template(const char* tmpl)
+{
+    int d = 0, s = 0;
+
+    if (strchr(tmpl, '/'))
+        return -1;
+    for (const char* p = tmpl; *p; p++)
+    {
+        if (*p != '%')
+            continue;
+        p++;
+        if (*p == '%')
+            continue;
+        if (*p == 's')
+        {
+            s++;
+            continue;
+        }
+        while (isdigit((unsigned char) *p))
+            p++;
+        if (*p != 'd')
+            return -1;
+        d++;
+    }
+    return d == 1 && s <= 1 ? 0 : -1;
+}
+
+
+// Escribe en `buf` el nombre del trozo `n`
+void chunk_name(const struct chunk_out* out, int n, char* buf, size_t size)
+{
+    const char* tmpl = out->opts->tmpl;
+    size_t len = 0;
+
+    if (tmpl == NULL)
+    {
+        snprintf(buf, size, "%s%d", out->base, n);
+        return;
+    }
+
+    buf[0] = 0;
+    for (const char* p = tmpl; *p && len + 1 < size; p++)
+    {
+        if (*p != '%')
+        {
+            buf[len++] = *p;
+            buf[len] = 0;
+            continue;
+        }
+        p++;
+        if (*p == '%')
+        {
+            buf[len++] = '%';
+            buf[len] = 0;
+        }
+        else if (*p == 's')
+            len += snprintf(buf + len, size - len, "%s", out->base);
+        else
+        {
+            int zero = *p == '0';
+            int width = strtol(p, (char**) &p, 10);
+            len += snprintf(buf + len, size - len, zero ? "%0*d" : "%*d", width, n);
+        }
+        if (len >= size)
+            len = size - 1;
+    }
+}
+
+
+// Subdirectorio que corresponde al trozo `name`
+int chunk_shard_index(const char* name)
+{
+    return fnv1a64(FNV1A_INIT, name, strlen(name)) % PSPLIT_SHARDS;
+}
+
+
+// Descriptor del subdirectorio en el que va el trozo `name`
+int chunk_shard(struct chunk_out* out, const char* name)
+{
+    int shard = chunk_shard_index(name);
+    char sub[4];
+
+    if (out->shard_fd[shard] >= 0)
+        return out->shard_fd[shard];
+
+    // Otros trabajadores de `psplit -p` pueden crearlo a la vez
+    snprintf(sub, sizeof(sub), "%02x", shard);
+    if (mkdirat(out->dirfd, sub, 0777) < 0 && errno != EEXIST)
+    {
+        perror("mkdirat");
+        exit(EXIT_FAILURE);
+    }
+    TRY( out->shard_fd[shard] = openat(out->dirfd, sub, O_RDONLY | O_DIRECTORY | O_CLOEXEC) );
+    return out->shard_fd[shard];
+}
+
+
+void chunk_out_init(struct chunk_out* out, const struct psplit_output* opts, char* file)
+{
+    out->opts = opts;
+    out->fd = -1;
+    out->count = 0;
+    out->sharded = 0;
+    out->pos = 0;
+    out->recs = NULL;
+    out->cap = 0;
+    for (int i = 0; i < PSPLIT_SHARDS; i++)
+        out->shard_fd[i] = -1;
+
+    if (opts->dir == NULL)
+    {
+        out->base = file;
+        out->dirfd = AT_FDCWD;
+        return;
+    }
+    out->base = basename(file);
+    if (mkdir(opts->dir, 0777) < 0 && errno != EEXIST)
+    {
+        perror(opts->dir);
+        exit(EXIT_FAILURE);
+    }
+    if ((out->dirfd = open(opts->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+    {
+        perror(opts->dir);
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+void write_manifest(struct chunk_out*);
+void chunk_close(struct chunk_out*);
+
+
+void chunk_out_close(struct chunk_out* out)
+{
+    if (out->fd >= 0)
+        chunk_close(out);
+    if (out->opts->manifest)
+        write_manifest(out);
+    if (out->cap)
+        free(out->recs);
+    for (int i = 0; i < PSPLIT_SHARDS; i++)
+        if (out->shard_fd[i] >= 0)
+            TRY( close(out->shard_fd[i]) );
+    if (out->dirfd != AT_FDCWD)
+        TRY( close(out->dirfd) );
+}
+
+
+// Crea el trozo `n` y devuelve su descriptor
+int chunk_open_at(struct chunk_out* out, int n)
+{
+    char name[PATH_MAX];
+    int fd, dirfd = out->dirfd;
+
+    chunk_name(out, n, name, sizeof(name));
+    if (out->sharded)
+        dirfd = chunk_shard(out, name);
+    if ((fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRWXU)) < 0)
+    {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+
+// Crea el siguiente trozo y devuelve su descriptor
+int chunk_open(struct chunk_out* out)
+{
+    char name[PATH_MAX];
+
+    if (!out->sharded && out->opts->shard_after > 0 && out->count >= out->opts->shard_after)
+    {
+        // Se reparten también los trozos que ya existían
+        for (int n = 0; n < out->count; n++)
+        {
+            chunk_name(out, n, name, sizeof(name));
+            if (renameat(out->dirfd, name, chunk_shard(out, name), name) < 0)
+            {
+                perror("renameat");
+                exit(EXIT_FAILURE);
+            }
+        }
+        out->sharded = 1;
+    }
+
+    if (out->opts->manifest)
+    {
+        if (out->count == out->cap)
+        {
+            out->cap = out->cap ? out->cap * 2 : 64;
+            if ((out->recs = realloc(out->recs, out->cap * sizeof(*out->recs))) == NULL)
+            {
+                perror("chunk_open: realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        out->recs[out->count] = (struct chunk_rec) { .offset = out->pos };
+    }
+
+    return out->fd = chunk_open_at(out, out->count++);
+}
+
+
+// Anota `len` bytes de `data` escritos en el trozo abierto. Con `-m` el
+// CRC32C y las líneas se calculan aquí, sobre el mismo búfer que se acaba de
+// escribir, sin volver a leer el trozo.
+void chunk_data(struct chunk_out* out, const char* data, size_t len)
+{
+    out->pos += len;
+    if (!out->opts->manifest)
+        return;
+
+    struct chunk_rec* rec = &out->recs[out->count - 1];
+    rec->length += len;
+    rec->crc = crc32c(rec->crc, data, len);
+    for (const char* p = data; (p = memchr(p, '\n', data + len - p)) != NULL; p++)
+        rec->lines++;
+}
+
+
+void chunk_close(struct chunk_out* out)
+{
+    TRY( fsync(out->fd) );
+    TRY( close(out->fd) );
+    out->fd = -1;
+}
+
+
+// Escribe `s` como cadena JSON
+void json_string(FILE* f, const char* s)
+{
+    putc('"', f);
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if ((unsigned char) *s < 0x20)
+            fprintf(f, "\\u%04x", *s);
+        else
+            putc(*s, f);
+    }
+    putc('"', f);
+}
+
+
+// Escribe el manifiesto `BASE.manifest.json` junto a los trozos: un objeto
+// por línea con el nombre de cada trozo (relativo al manifiesto), su posición
+// y longitud en la entrada, sus líneas y su CRC32C
+void write_manifest(struct chunk_out* out)
+{
+    char name[PATH_MAX + 32];
+    int fd;
+    FILE* f;
+
+    snprintf(name, sizeof(name), "%s.manifest.json", out->base);
+    if ((fd = openat(out->dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0 ||
+            (f = fdopen(fd, "w")) == NULL)
+    {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(f, "{\"source\": ");
+    json_string(f, out->base);
+    fprintf(f, ", \"checksum\": \"crc32c\", \"chunks\": [\n");
+    for (int i = 0; i < out->count; i++)
+    {
+        char chunk[PATH_MAX], path[PATH_MAX + 4];
+        struct chunk_rec* rec = &out->recs[i];
+
+        chunk_name(out, i, chunk, sizeof(chunk));
+        if (out->sharded)
+            snprintf(path, sizeof(path), "%02x/%s", chunk_shard_index(chunk), chunk);
+        else
+            snprintf(path, sizeof(path), "%s", chunk);
+        fprintf(f, "{\"name\": ");
+        json_string(f, path);
+        fprintf(f, ", \"offset\": %lld, \"length\": %lld, \"lines\": %lld, \"crc32c\": \"%08x\"}%s\n",
+                rec->offset, rec->length, rec->lines, rec->crc, i + 1 < out->count ? "," : "");
+    }
+    fprintf(f, "]}\n");
+    if (fflush(f) == EOF || fsync(fd) < 0)
+    {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+    fclose(f);
+}
+
+
+// Lee la cadena JSON que empieza en `p` (tras las comillas) en `buf`.
+// Devuelve un puntero a continuación de las comillas finales o NULL.
+const char* json_parse_string(const char* p, char* buf, size_t size)
+{
+    size_t len = 0;
+
+    for (; *p && *p != '"'; p++)
+    {
+        int c = *p;
+        if (c == '\\')
+        {
+            p++;
+            if (*p == 'u')
+            {
+                unsigned code;
+                if (sscanf(p + 1, "%4x", &code) != 1)
+                    return NULL;
+                c = code;
+                p += 4;
+            }
+            else if (*p == 'n')
+                c = '\n';
+            else if (*p == 't')
+                c = '\t';
+            else
+                c = *p;
+        }
+        if (c == 0 || len + 1 >= size)
+            return NULL;
+        buf[len++] = c;
+    }
+    buf[len] = 0;
+    return *p == '"' ? p + 1 : NULL;
+}
+
+
+struct manifest_chunk {
+    char name[PATH_MAX];
+    struct chunk_rec rec;
+};
+
+
+// Comprueba el trozo `m` del directorio `dirfd`. Devuelve 0 si coincide con
+// el manifiesto.
+int verify_chunk(int dirfd, const struct manifest_chunk* m)
+{
+    char buf[BSIZE * 64];
+    struct chunk_rec got = { 0 };
+    ssize_t n;
+    int fd;
+
+    if ((fd = openat(dirfd, m->name, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+        printf("psplit: %s: %s\n", m->name, strerror(errno));
+        return -1;
+    }
+    while ((n = read(fd, buf, sizeof(buf))) != 0)
+    {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            printf("psplit: %s: %s\n", m->name, strerror(errno));
+            TRY( close(fd) );
+            return -1;
+        }
+        got.length += n;
+        got.crc = crc32c(got.crc, buf, n);
+        for (const char* p = buf; (p = memchr(p, '\n', buf + n - p)) != NULL; p++)
+            got.lines++;
+    }
+    TRY( close(fd) );
+
+    if (got.length != m->rec.length)
+        printf("psplit: %s: longitud %lld, se esperaba %lld\n", m->name, got.length, m->rec.length);
+    else if (got.lines != m->rec.lines)
+        printf("psplit: %s: %lld líneas, se esperaban %lld\n", m->name, got.lines, m->rec.lines);
+    else if (got.crc != m->rec.crc)
+        printf("psplit: %s: CRC32C %08x, se esperaba %08x\n", m->name, got.crc, m->rec.crc);
+    else
+        return 0;
+    return -1;
+}
+
+
+// Comprueba los trozos del manifiesto `path` repartiéndolos entre `procs`
+// procesos. Devuelve el número de trozos erróneos o -1 si el manifiesto no
+// se puede leer.
+int verify_manifest(const char* path, int procs)
+{
+    struct manifest_chunk* chunks = NULL;
+    int nchunks = 0, cap = 0, dirfd;
+    char* text;
+    char dir[PATH_MAX];
+    FILE* f;
+    size_t len = 0;
+
+    if ((f = fopen(path, "r")) == NULL)
+    {
+        printf("psplit: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    text = NULL;
+    for (ssize_t n; (n = getline(&text, &len, f)) > 0; )
+    {
+        const char* p = strstr(text, "{\"name\": \"");
+        struct manifest_chunk* m;
+
+        if (p == NULL)
+            continue;
+        if (nchunks == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            if ((chunks = realloc(chunks, cap * sizeof(*chunks))) == NULL)
+            {
+                perror("verify_manifest: realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        m = &chunks[nchunks];
+        if ((p = json_parse_string(p + 10, m->name, sizeof(m->name))) == NULL ||
+                sscanf(p, ", \"offset\": %lld, \"length\": %lld, \"lines\": %lld, \"crc32c\": \"%x\"",
+                    &m->rec.offset, &m->rec.length, &m->rec.lines, &m->rec.crc) != 4)
+        {
+            printf("psplit: %s: entrada no válida: %s", path, text);
+            continue;
+        }
+        nchunks++;
+    }
+    free(text);
+    fclose(f);
+
+    // Los nombres son relativos al directorio del manifiesto
+    snprintf(dir, sizeof(dir), "%s", path);
+    if ((dirfd = open(dirname(dir), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+    {
+        printf("psplit: %s: %s\n", dir, strerror(errno));
+        free(chunks);
+        return -1;
+    }
+
+    // Cada trabajador suma sus errores en un contador compartido
+    int* bad;
+    if ((bad = mmap(NULL, sizeof(*bad), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    *bad = 0;
+    if (procs > nchunks)
+        procs = nchunks;
+    if (procs <= 1)
+    {
+        for (int i = 0; i < nchunks; i++)
+            *bad += verify_chunk(dirfd, &chunks[i]) < 0;
+    }
+    else
+    {
+        pid_t pid[procs];
+        fflush(stdout);
+        for (int w = 0; w < procs; w++)
+            if ((pid[w] = fork_or_panic("fork psplit -V")) == 0)
+            {
+                int mine = 0;
+                for (int i = w; i < nchunks; i += procs)
+                    mine += verify_chunk(dirfd, &chunks[i]) < 0;
+                fflush(stdout);
+                __atomic_fetch_add(bad, mine, __ATOMIC_RELAXED);
+                exit(EXIT_SUCCESS);
+            }
+        for (int w = 0; w < procs; w++)
+            wait_child(pid[w]);
+    }
+
+    int result = *bad;
+    printf("psplit: %s: %d trozos, %d erróneos\n", path, nchunks, result);
+    TRY( munmap(bad, sizeof(*bad)) );
+    TRY( close(dirfd) );
+    free(chunks);
+    return result;
+}
+
+
+// `process_splice` trocea por bytes una entrada que es una tubería moviendo
+// los datos con `splice`, sin copiarlos al espacio de usuario. Así `psplit`
+// al final de una tubería no paga dos copias por cada byte.
+void process_splice(struct chunk_out * out, int fd_read, int maxBytes)
+{
+    int fd_write;
+    ssize_t moved = 0;
+    struct pollfd pfd = { .fd = fd_read, .events = POLLIN };
+
+    for (;;)
+    {
+        // Solo se crea un fichero si quedan datos: espera a que lleguen o a
+        // que se cierre la tubería
+        int avail = 0;
+        while (poll(&pfd, 1, -1) < 0)
+            if (errno != EINTR) {
+                perror("poll");
+                exit(EXIT_FAILURE);
+            }
+        TRY( ioctl(fd_read, FIONREAD, &avail) );
+        if (avail == 0)
+            break;
+
+        fd_write = chunk_open(out);
+
+        int bytes_left = maxBytes;
+        while (bytes_left > 0 &&
+               (moved = splice(fd_read, NULL, fd_write, NULL, bytes_left,
+                               SPLICE_F_MOVE | SPLICE_F_MORE)) > 0)
+            bytes_left -= moved;
+        if (moved < 0) {
+            perror("splice");
+            exit(EXIT_FAILURE);
+        }
+
+        chunk_close(out);
+        if (bytes_left > 0)
+            break;
+    }
+}
+
+
+// `psplit -n`: divide un fichero regular en `n` trozos equilibrados sin
+// recorrerlo. Por bytes, los límites salen directamente del tamaño; por
+// líneas (`-n l/N`), cada límite aproximado se desplaza hasta el siguiente
+// salto de línea leyendo solo unos KB a partir de él. Los datos se copian con
+// `copy_file_range`, dentro del núcleo, y con `-p` cada trabajador escribe un
+// grupo contiguo de trozos.
+
+// Devuelve la posición siguiente al primer salto de línea en `fd` a partir de
+// `off`, o `size` si no hay ninguno
+off_t next_line(int fd, off_t off, off_t size)
+{
+    char buf[BSIZE];
+    ssize_t n;
+
+    while (off < size)
+    {
+        if ((n = pread(fd, buf, sizeof(buf), off)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("pread");
+            exit(EXIT_FAILURE);
+        }
+        if (n == 0)
+            break;
+        char* nl = memchr(buf, '\n', n);
+        if (nl)
+            return off + (nl - buf) + 1;
+        off += n;
+    }
+    return size;
+}
+
+
+// Copia `len` bytes de `fd_in` desde `off` en `fd_out`. Sin manifiesto se usa
+// `copy_file_range`; con él los datos pasan por un búfer para calcular el
+// CRC32C y las líneas del trozo en `rec`.
+void copy_range(int fd_in, off_t off, off_t len, int fd_out, struct chunk_rec* rec)
+{
+    char buf[BSIZE * 64];
+    ssize_t n;
+
+    while (rec == NULL && len > 0)
+    {
+        if ((n = copy_file_range(fd_in, &off, fd_out, NULL, len, 0)) > 0)
+        {
+            len -= n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n == 0 || errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                errno == EOPNOTSUPP)
+            break;      // Se termina con `pread`/`write`
+        perror("copy_file_range");
+        exit(EXIT_FAILURE);
+    }
+
+    while (len > 0)
+    {
+        if ((n = pread(fd_in, buf, len < (off_t) sizeof(buf) ? len : (off_t) sizeof(buf), off)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("pread");
+            exit(EXIT_FAILURE);
+        }
+        if (n == 0)
+            break;
+        if (write_all(fd_out, buf, n) < 0)
+        {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        if (rec)
+        {
+            rec->length += n;
+            rec->crc = crc32c(rec->crc, buf, n);
+            for (const char* p = buf; (p = memchr(p, '\n', buf + n - p)) != NULL; p++)
+                rec->lines++;
+        }
+        off += n;
+        len -= n;
+    }
+}
+
+
+// Escribe los trozos `first` a `last - 1`, delimitados por `bounds`
+void write_nchunks(struct chunk_out* out, int fd_in, const off_t* bounds, int first, int last)
+{
+    for (int i = first; i < last; i++)
+    {
+        out->fd = chunk_open_at(out, i);
+        copy_range(fd_in, bounds[i], bounds[i + 1] - bounds[i], out->fd,
+                   out->recs ? &out->recs[i] : NULL);
+        chunk_close(out);
+    }
+}
+
+
+void process_nchunks(char* file, int n, int by_lines, int procs,
+        const struct psplit_output* output)
+{
+    struct chunk_out out;
+    struct stat st;
+    int fd_read;
+
+    if (!strcmp("stdin", file))
+        fd_read = STDIN_FILENO;
+    else if ((fd_read = open(file, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+        printf("psplit: %s: %s\n", file, strerror(errno));
+        g_status = 1;
+        return;
+    }
+    TRY( fstat(fd_read, &st) );
+    if (!S_ISREG(st.st_mode))
+    {
+        printf("psplit: %s: -n necesita un fichero regular\n", file);
+        g_status = 1;
+        if (fd_read != STDIN_FILENO)
+            TRY( close(fd_read) );
+        return;
+    }
+
+    // Con `-n l/N` un límite nunca queda antes que el anterior: si una línea
+    // ocupa varios trozos, los siguientes quedan vacíos
+    off_t* bounds;
+    if ((bounds = malloc((n + 1) * sizeof(*bounds))) == NULL)
+    {
+        perror("process_nchunks: malloc");
+        exit(EXIT_FAILURE);
+    }
+    bounds[0] = 0;
+    bounds[n] = st.st_size;
+    for (int i = 1; i < n; i++)
+    {
+        bounds[i] = (off_t) ((long double) st.st_size * i / n);
+        if (by_lines && bounds[i] > 0)
+            bounds[i] = next_line(fd_read, bounds[i] - 1, st.st_size);
+        if (bounds[i] < bounds[i - 1])
+            bounds[i] = bounds[i - 1];
+    }
+
+    chunk_out_init(&out, output, file);
+    out.sharded = output->shard_after > 0 && n > output->shard_after;
+    if (output->manifest)
+    {
+        // Los trabajadores rellenan cada uno los registros de sus trozos
+        if ((out.recs = mmap(NULL, n * sizeof(*out.recs), PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+        {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < n; i++)
+            out.recs[i] = (struct chunk_rec) { .offset = bounds[i] };
+    }
+
+    if (procs > n)
+        procs = n;
+    if (procs <= 1)
+        write_nchunks(&out, fd_read, bounds, 0, n);
+    else
+    {
+        pid_t pid[procs];
+        fflush(stdout);
+        for (int w = 0; w < procs; w++)
+            if ((pid[w] = fork_or_panic("fork psplit -n")) == 0)
+            {
+                if (g_placement)
+                    place_worker(w);
+                if (g_bg_workers)
+                    apply_prio_class(0, &g_bg_class);
+                write_nchunks(&out, fd_read, bounds, n * w / procs, n * (w + 1) / procs);
+                exit(EXIT_SUCCESS);
+            }
+        for (int w = 0; w < procs; w++)
+            if (wait_child(pid[w]) != 0)
+                g_status = 1;
+    }
+
+    out.count = n;
+    out.pos = st.st_size;
+    chunk_out_close(&out);
+    if (out.recs)
+        TRY( munmap(out.recs, n * sizeof(*out.recs)) );
+    free(bounds);
+    if (fd_read != STDIN_FILENO)
+        TRY( close(fd_read) );
+}
+
+
+// `psplit -F N -c CMD`: en lugar de escribir trozos, arranca N copias de la
+// línea de órdenes CMD (analizada y ejecutada por el propio shell, con
+// `PSPLIT_WORKER` igual a su número) y les reparte la entrada por tuberías:
+// una línea cada vez o bloques de `-l` líneas o `-b` bytes.
+//
+// Las tuberías no bloquean y cada consumidor tiene un búfer de salida. Un
+// bloque nuevo va al siguiente consumidor en orden circular cuyo búfer tenga
+// sitio, así que uno lento se salta en vez de frenar a los demás; solo se
+// espera a un consumidor concreto si su bloque a medias no cabe.
+
+#define FANOUT_BUF (256 * 1024)   // Pendiente por consumidor antes de saltarlo
+#define MAX_FANOUT 256            // Consumidores como máximo
+
+struct fanout {
+    int fd;                 // Extremo de escritura; -1 si el consumidor terminó
+    pid_t pid;
+    char* buf;
+    size_t len, off, cap;   // Datos pendientes: buf[off..len)
+};
+
+
+// Añade `len` bytes al búfer pendiente de `c`
+void fanout_append(struct fanout* c, const char* data, size_t len)
+{
+    if (c->fd < 0)
+        return;
+    if (c->off > 0 && c->off == c->len)
+        c->off = c->len = 0;
+    if (c->len + len > c->cap && c->off > 0)
+    {
+        memmove(c->buf, c->buf + c->off, c->len - c->off);
+        c->len -= c->off;
+        c->off = 0;
+    }
+    // Solo crece si todos los consumidores estaban llenos
+    if (c->len + len > c->cap)
+    {
+        c->cap = c->len + len;
+        if ((c->buf = realloc(c->buf, c->cap)) == NULL)
+        {
+            perror("fanout_append: realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(c->buf + c->len, data, len);
+    c->len += len;
+}
+
+
+// Escribe todo lo que admita la tubería de `c` sin bloquear
+void fanout_flush(struct fanout* c)
+{
+    ssize_t n;
+
+    while (c->fd >= 0 && c->off < c->len)
+    {
+        if ((n = write(c->fd, c->buf + c->off, c->len - c->off)) > 0)
+            c->off += n;
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else if (n < 0 && errno == EAGAIN)
+            return;
+        else
+        {
+            // El consumidor ha cerrado su entrada: lo que le quedaba se pierde
+            if (errno != EPIPE)
+                perror("psplit: write");
+            TRY( close(c->fd) );
+            c->fd = -1;
+        }
+    }
+}
+
+
+int fanout_room(struct fanout* c)
+{
+    return c->fd >= 0 && c->len - c->off < FANOUT_BUF;
+}
+
+
+// Reparte `fd_in` entre los consumidores `c`. `block` es el número de líneas
+// (o de bytes si `by_bytes`) que recibe cada consumidor en su turno.
+void fanout_stream(int fd_in, struct fanout* c, int n, long block, int by_bytes)
+{
+    char buf[BSIZE * 64];
+    struct pollfd pfd[n + 1];
+    int cur = n - 1, eof = 0;
+    long left = 0;          // Lo que falta del bloque del consumidor `cur`
+
+    for (;;)
+    {
+        int np = 0, live = 0, pending = 0, want_input;
+
+        for (int i = 0; i < n; i++)
+        {
+            fanout_flush(&c[i]);
+            live += c[i].fd >= 0;
+            if (c[i].fd >= 0 && c[i].off < c[i].len)
+            {
+                pfd[np++] = (struct pollfd) { .fd = c[i].fd, .events = POLLOUT };
+                pending = 1;
+            }
+        }
+        if (live == 0 || (eof && !pending))
+            break;
+
+        // Se lee más si hay dónde ponerlo
+        want_input = !eof && (left > 0 && c[cur].fd >= 0 ? fanout_room(&c[cur]) : 0);
+        for (int i = 0; !eof && !want_input && (left == 0 || c[cur].fd < 0) && i < n; i++)
+            want_input = fanout_room(&c[i]);
+        if (want_input)
+            pfd[np++] = (struct pollfd) { .fd = fd_in, .events = POLLIN };
+
+        if (poll(pfd, np, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+        if (!want_input || pfd[np - 1].revents == 0)
+            continue;
+
+        ssize_t got = read(fd_in, buf, sizeof(buf));
+        if (got < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (got < 0)
+        {
+            perror("psplit: read");
+            eof = 1;
+            g_status = 1;
+            continue;
+        }
+        if (got == 0)
+        {
+            eof = 1;
+            continue;
+        }
+
+        for (char* p = buf; p < buf + got; )
+        {
+            size_t len = buf + got - p;
+
+            if (left == 0 || c[cur].fd < 0)
+            {
+                // Bloque nuevo: siguiente consumidor con sitio o, si no hay
+                // ninguno, el siguiente vivo
+                int next = -1;
+                for (int i = 1; i <= n && next < 0; i++)
+                    if (fanout_room(&c[(cur + i) % n]))
+                        next = (cur + i) % n;
+                for (int i = 1; i <= n && next < 0; i++)
+                    if (c[(cur + i) % n].fd >= 0)
+                        next = (cur + i) % n;
+                if (next < 0)
+                    break;
+                cur = next;
+                left = block;
+            }
+
+            if (by_bytes)
+            {
+                if ((long) len > left)
+                    len = left;
+                left -= len;
+            }
+            else
+            {
+                char* nl = p;
+                while (left > 0 && (nl = memchr(nl, '\n', buf + got - nl)) != NULL)
+                {
+                    nl++;
+                    left--;
+                }
+                if (left == 0)
+                    len = nl - p;
+            }
+            fanout_append(&c[cur], p, len);
+            p += len;
+        }
+    }
+}
+
+
+// Lanza `n` consumidores que ejecutan `cmd`, ya analizada, y les reparte
+// `files` (o la entrada estándar)
+void fanout_run(char** files, int nfiles, int n, struct cmd* cmd, long block,
+        int by_bytes)
+{
+    struct fanout c[n];
+    struct sigaction ign = { .sa_handler = SIG_IGN }, old;
+    int fds[n][2];
+
+    // Todas las tuberías existen antes del primer `fork`: cada consumidor
+    // cierra las de los demás para que vean el final de su entrada
+    for (int i = 0; i < n; i++)
+    {
+        if (pipe_sized(fds[i]) < 0)
+        {
+            perror("psplit: pipe");
+            while (i-- > 0)
+            {
+                TRY( close(fds[i][0]) );
+                TRY( close(fds[i][1]) );
+            }
+            g_status = 1;
+            return;
+        }
+    }
+    fflush(stdout);
+    for (int i = 0; i < n; i++)
+    {
+        if ((c[i].pid = fork_or_panic("fork psplit -F")) == 0)
+        {
+            char worker[16];
+
+            TRY( dup2(fds[i][0], STDIN_FILENO) );
+            // El padre ya ha cerrado los extremos de lectura anteriores
+            for (int j = 0; j < n; j++)
+            {
+                if (j >= i)
+                    TRY( close(fds[j][0]) );
+                TRY( close(fds[j][1]) );
+            }
+            snprintf(worker, sizeof(worker), "%d", i);
+            TRY( setenv("PSPLIT_WORKER", worker, 1) );
+            if (g_placement)
+                place_worker(i);
+            if (g_bg_workers)
+                apply_prio_class(0, &g_bg_class);
+
+            // Como en `start_job`, la última orden ocupa este proceso
+            run_tail(cmd);
+        }
+        TRY( close(fds[i][0]) );
+        c[i].fd = fds[i][1];
+        TRY( fcntl(c[i].fd, F_SETFL, O_NONBLOCK) );
+        c[i].len = c[i].off = 0;
+        c[i].cap = FANOUT_BUF + BSIZE * 64;
+        if ((c[i].buf = malloc(c[i].cap)) == NULL)
+        {
+            perror("process_fanout: malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Un consumidor que termina antes de tiempo no debe matar al shell
+    TRY( sigaction(SIGPIPE, &ign, &old) );
+    if (nfiles == 0)
+        fanout_stream(STDIN_FILENO, c, n, block, by_bytes);
+    for (int i = 0; i < nfiles; i++)
+    {
+        int fd;
+        if ((fd = open(files[i], O_RDONLY | O_CLOEXEC)) < 0)
+        {
+            printf("psplit: %s: %s\n", files[i], strerror(errno));
+            g_status = 1;
+            continue;
+        }
+        fanout_stream(fd, c, n, block, by_bytes);
+        TRY( close(fd) );
+    }
+    TRY( sigaction(SIGPIPE, &old, NULL) );
+
+    for (int i = 0; i < n; i++)
+    {
+        if (c[i].fd >= 0)
+            TRY( close(c[i].fd) );
+        free(c[i].buf);
+    }
+    for (int i = 0; i < n; i++)
+    {
+        int status = wait_child(c[i].pid);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            g_status = 1;
+    }
+}
+
+
+void process_fanout(char** files, int nfiles, int n, const char* line, long block,
+        int by_bytes)
+{
+    char* buf;
+    struct cmd* cmd;
+
+    // La orden se analiza una sola vez, aquí: con un error sintáctico no se
+    // lanza ningún consumidor. Los here-documents se leerían de la misma
+    // entrada que se reparte, así que no se admiten.
+    if ((buf = strdup(line)) == NULL)
+    {
+        perror("process_fanout: strdup");
+        exit(EXIT_FAILURE);
+    }
+    cmd = parse_cmd(buf);
+    null_terminate(cmd);
+    if (cmd == NULL || g_parse_error)
+        g_status = 1;
+    else if (has_heredoc(cmd) ||
+            (cmd->type == EXEC && ((struct execcmd*) cmd)->argv[0] == NULL))
+    {
+        printf("psplit: Orden -c no válida (vacía o con here-documents)\n");
+        g_status = 1;
+    }
+    else
+        fanout_run(files, nfiles, n, cmd, block, by_bytes);
+
+    if (cmd != NULL)
+    {
+        free_cmd(cmd);
+        free(cmd);
+    }
+    free(buf);
+}
+
+
+void process_option(char * file, int size,int l,int maxLines,int b,int maxBytes,
+        const struct psplit_output * output)
+{   
+    int fd_read,fd_write = -1;
+    struct chunk_out out;
+	if(!strcmp("stdin",file))
+        fd_read = STDIN_FILENO; //Si es la entrada estandar, ponemos que vamos a leerla
+	else
+    {
+    	if ((fd_read = open(file, O_RDONLY)) < 0) //Sino leeremos el fichero especificado
+    	{
+        	perror("open");
+        	exit(EXIT_FAILURE);
+    	}
+	}
+
+    chunk_out_init(&out, output, file);
+    struct stat st;
+    TRY( fstat(fd_read, &st) );
+    // `splice` no pasa los datos por el espacio de usuario: con manifiesto
+    // hace falta verlos para calcular el CRC
+    if (b && S_ISFIFO(st.st_mode) && !output->manifest) {
+        process_splice(&out, fd_read, maxBytes);
+        chunk_out_close(&out);
+        if(fd_read!= STDIN_FILENO)
+            TRY( close(fd_read) );
+        return;
+    }
+
+    int offset = 0;
+    int written = 0; int bytes_read = 0;
+    char buf[size];
+    int bytes_left = maxBytes;
+    int lines = maxLines;
+    int i,j;
+    int entrado = 0;
+    int empezado = 1;
+    while ((bytes_read = read(fd_read, buf,size))> 0)
+    {   
+        if(bytes_read == -1){
+            perror("read");
+            exit(EXIT_FAILURE);
+        }
+        i = 0;
+        offset = 0;
+	    //En caso de que hayamos puesto la opción de l
+        if(l) {
+	        //Mientras aún queden bytes leidos por escribir
+            while(bytes_read) 
+			{              
+                if((lines == maxLines && entrado) || empezado) /* Por si en la primera iteracion no se llega a escribir una linea entera,
+                                                                    asi evitamos que se creen archivos infinitos.*/
+                {
+                    empezado =0;
+                    fd_write = chunk_open(&out);
+                }
+                /* Contamos el numero de lineas que vamos a escribir (restar a lineas restantes)*/
+                for(j=0;j < bytes_read && lines;j++){
+                    if(buf[offset+j]=='\n'){ // Contamos desde offset hasta offset+bytes_read
+                        entrado = 1;
+                        lines--;
+                    }
+                }
+                    // Escribimos
+                    int partial = 0;
+                    while((written = write(fd_write,buf+offset,j-partial))>0)
+					{
+                            chunk_data(&out,buf+offset,written);
+                            offset+=written;
+                            bytes_read-=written;
+                            partial+=written;
+                            
+
+                    }
+                    if(written == -1){
+                        perror("write");
+                        exit(EXIT_FAILURE);
+                    }
+                    // Si no quedan lineas cerramos el archivo actual.
+                    if(lines == 0)
+				    {
+                        lines = maxLines; 
+                        chunk_close(&out);
+                    }
+
+                
+        
+            }
+   	
+        }else
+		{ 
+            while(bytes_read)
+            {
+            //Si los que quedan por colocar son el número maximo a tener
+                if(bytes_left == maxBytes)
+                {
+                    fd_write = chunk_open(&out);
+                }
+                //Mientras queden bytes por colocar y leer
+                while(bytes_left > 0 &&  bytes_read > 0)
+                {
+                    // ejemplo de querer escribir 2 bytes y leer 1 byte  
+					//Nos aseguramos de no escribir de más
+                    if(bytes_left >= bytes_read)
+					{
+                        i = bytes_read; //escribimos los maximos bytes posibles en cada iteracion
                     }else 
 					{ 
                         i = bytes_left;
                     }
-					//Vamos a escribir
-                    while((written = write(fd_write,buf+offset,i))>0)
-					{
-                        offset+=written;
-                        bytes_read-=written;
-                     	i-=written;
-                        bytes_left-=written;
+					//Vamos a escribir
+                    while((written = write(fd_write,buf+offset,i))>0)
+					{
+                        chunk_data(&out,buf+offset,written);
+                        offset+=written;
+                        bytes_read-=written;
+                     	i-=written;
+                        bytes_left-=written;
+                    }
+                    if(written == -1){
+                        perror("write");
+                        exit(EXIT_FAILURE);
+                    }
+                 }
+                 if(bytes_left == 0){
+                    bytes_left = maxBytes;
+                    chunk_close(&out);
+            	}
+            }
+        }
+	}
+    chunk_out_close(&out);
+    if(fd_read!= STDIN_FILENO)
+        TRY( close(fd_read) );
+}
+void run_psplit(struct execcmd * cmd){
+    int opt;
+    optind = 1;
+    int size = BSIZE;
+    int lines_per_file,bytes_per_file;
+    lines_per_file = bytes_per_file = 0;
+    int b =0;int l = 0; int p = 0; int index = 0;
+    int procs_per_file = 0;
+    struct psplit_output output = { NULL, NULL, PSPLIT_SHARD_AFTER, 0 };
+    int verify = 0;
+    int nchunks = 0, nlines = 0;
+    int consumers = 0;
+    char * consumer_cmd = NULL;
+    
+    while ((opt = getopt(cmd->argc, cmd->argv, "hl:b:s:p:d:t:S:mVn:F:c:")) != -1) {
+        switch (opt) {
+            case 'F':
+                if((consumers = atoi(optarg)) < 1 || consumers > MAX_FANOUT){
+                    printf("psplit: Opción -F no válida (1-%d)\n",MAX_FANOUT);
+                    return;
+                }
+                break;
+            case 'c':
+                consumer_cmd = optarg;
+                break;
+            case 'n':
+                nlines = !strncmp(optarg, "l/", 2);
+                if((nchunks = atoi(optarg + 2 * nlines)) < 1){
+                    printf("psplit: Opción -n no válida, debe ser N o l/N\n");
+                    return;
+                }
+                break;
+            case 'm':
+                output.manifest = 1;
+                break;
+            case 'V':
+                verify = 1;
+                break;
+            case 'd':
+                output.dir = optarg;
+                break;
+            case 't':
+                if(check_chunk_template(optarg) < 0){
+                    printf("psplit: Opción -t no válida, la plantilla debe tener un %%d y como mucho un %%s\n");
+                    return;
+                }
+                output.tmpl = optarg;
+                break;
+            case 'S':
+                if(atoi(optarg) < 0){
+                    printf("psplit: Opción -S no válida\n");
+                    return;
+                }
+                output.shard_after = atoi(optarg);
+                break;
+            case 's':
+                size = atoi(optarg);
+                if(size < 1 || size > pow(2,20)){
+                    printf("psplit: Opción -s no válida\n");
+                    return;
+                }
+                break;
+            case 'b':
+                if(!optarg || atoi(optarg) == 0){
+                    printf("psplit: Opción -b no válida, debe de establecer un tamaño en bytes\n");
+                    return;                    
+                }else{
+                    bytes_per_file = atoi(optarg);
+                    b = 1;
+                }
+                break;
+
+            case 'l':
+                if(!optarg || atoi(optarg) == 0){
+                    printf("psplit: Opción -l no válida, debe de establecer el número de lineas\n");
+                    return;                    
+                }else{
+                    lines_per_file = atoi(optarg);
+                    l = 1;
+
+                }
+                break;
+            case 'p':
+                if(!optarg || atoi(optarg) == 0){
+                    printf("psplit: Opción -p no válida\n");
+                    return;
+                 }else{
+                     procs_per_file = atoi(optarg);
+                     p = procs_per_file;
+                 }
+                break;
+            case 'h':
+            	printf("Uso: psplit [-l NLINES] [-b NBYTES] [-n [l/]N] [-F N -c CMD] [-s BSIZE] [-p PROCS] [-d DIR] [-t PLANTILLA] [-S N] [-m] [FILE1] [FILE2]...\n");
+				printf("Opciones:\n");
+				printf("-l NLINES Número máximo de líneas por fichero.\n");
+				printf("-b NBYTES Número máximo de bytes por fichero.\n");
+				printf("-n N      Divide cada fichero en N trozos de igual tamaño (l/N: sin\n");
+				printf("          partir líneas). Con -p los trozos se escriben en paralelo.\n");
+				printf("-F N      Reparte la entrada entre N copias de la orden de -c, una línea\n");
+				printf("          (o -l NLINES líneas o -b NBYTES bytes) a cada una por turno.\n");
+				printf("-c CMD    Orden que recibe los datos con -F; PSPLIT_WORKER es su número.\n");
+				printf("-s BSIZE  Tamaño en bytes de los bloques leídos de [FILEn] o stdin.\n");
+				printf("-p PROCS  Número máximo de procesos simultáneos.\n");
+				printf("-d DIR    Directorio en el que se crean los trozos.\n");
+				printf("-t PLANTILLA Nombre de los trozos: %%s es el fichero, %%d (p. ej. %%05d)\n");
+				printf("          el número del trozo y %%%% un %%.\n");
+				printf("-S N      Reparte los trozos en subdirectorios 00-ff si hay más de N\n");
+				printf("          (%d por defecto, 0 nunca).\n", PSPLIT_SHARD_AFTER);
+				printf("-m        Escribe FILE.manifest.json con la posición, longitud, líneas\n");
+				printf("          y CRC32C de cada trozo.\n");
+				printf("-V        Comprueba los trozos de los manifiestos indicados (en paralelo\n");
+				printf("          con -p).\n");
+				printf("-h        Ayuda\n");
+				printf("\n");
+				return;
+                break;
+            default: /* ? */
+                fprintf(stderr, "Usage: %s [-l NLINES] [-b NBYTES] [-n [l/]N] [-F N -c CMD] [-s BSIZE] [-p PROCS] [-d DIR] [-t TEMPLATE] [-S N] [-m] [FILE1] [FILE2]...\n", cmd->argv[0]);
+                return;
+        }
+    }
+    if((l && b) || (nchunks && (l || b))){
+        printf("psplit: Opciones incompatibles\n");
+        exit(EXIT_FAILURE);
+    }
+    if(verify){
+        for(int i = optind; i < cmd->argc; i++)
+            if(verify_manifest(cmd->argv[i], p ? procs_per_file : 1) != 0)
+                g_status = 1;
+        optind = 1;
+        return;
+    }
+    if(consumers || consumer_cmd){
+        if(!consumers || !consumer_cmd || nchunks || output.manifest){
+            printf("psplit: -F y -c van juntas y no admiten -n ni -m\n");
+            return;
+        }
+        process_fanout(cmd->argv + optind,cmd->argc - optind,consumers,consumer_cmd,
+                       l ? lines_per_file : b ? bytes_per_file : 1,b);
+        optind = 1;
+        return;
+    }
+    // Con -n los trabajadores de -p se reparten los trozos de cada fichero
+    if(nchunks){
+        if(optind == cmd->argc)
+            process_nchunks("stdin",nchunks,nlines,p ? procs_per_file : 1,&output);
+        for(int i = optind; i < cmd->argc; i++)
+            process_nchunks(cmd->argv[i],nchunks,nlines,p ? procs_per_file : 1,&output);
+        optind = 1;
+        return;
+    }
+    /* Si hemos parseado todo es que no hemos especificado ficheros por 
+        argumentos y debemos de coger la entrada estándar*/
+    if(optind == cmd->argc){
+        process_option("stdin",size,l,lines_per_file,b,bytes_per_file,&output);
+    }else{
+
+        if(p){
+            pid_t pid[procs_per_file];
+            memset(pid,-1,procs_per_file * sizeof(pid[0]));
+            for(int i = optind; i < cmd->argc; i++){
+                if(pid[index % procs_per_file] != -1){ //cola circular
+                    if(wait_child(pid[index % procs_per_file]) != 0)
+                        g_status = 1;
+                }
+
+                if ((pid[(index++) % procs_per_file] = fork_or_panic("fork psplit")) == 0){
+                    if (g_placement)
+                        place_worker((index - 1) % procs_per_file);
+                    if (g_bg_workers)
+                        apply_prio_class(0, &g_bg_class);
+                    process_option(cmd->argv[i],size,l,lines_per_file,b,bytes_per_file,&output); // Codigo del hijo
+                    exit(EXIT_SUCCESS);
+                }
+            }
+            
+           
+            for(int j = 0 ; j < procs_per_file; j++){
+                if(pid[j]!= -1 && wait_child(pid[j]) != 0){
+                    g_status = 1;
+                }
+            }
+            
+        }else {
+            for(int i = optind; i < cmd->argc; i++){
+                process_option(cmd->argv[i],size,l,lines_per_file,b,bytes_per_file,&output);
+            }
+        }
+        
+    }
+    optind = 1;
+}
+
+
+// Monitorización de las tareas en segundo plano (`bjobs -m`)
+//
+// Cada proceso del árbol de una tarea tiene una entrada en `g_mon` con los
+// descriptores de sus ficheros `stat`, `statm`, `io` y `children` de /proc
+// abiertos. Las muestras siguientes solo hacen `pread` sobre ellos, así que
+// refrescar cientos de tareas no cuesta un `open` por fichero y proceso. Un
+// descriptor de /proc sigue apuntando al proceso original aunque su PID se
+// reutilice: cuando el proceso termina, `pread` falla y la entrada se cierra.
+
+#define MON_MAX_PROCS 1024
+#define MON_BUF 1024
+
+struct monproc {
+    pid_t pid;
+    int fd_stat, fd_statm, fd_io, fd_children;
+    unsigned long long ticks;   // utime + stime de la última muestra
+    struct timespec sampled;    // Momento de la última muestra
+    int seen;                   // Visto en la pasada actual
+};
+
+struct jobstat {
+    int nprocs;
+    char state;
+    double cpu;                 // Porcentaje de una CPU
+    unsigned long long rss;     // Bytes
+    unsigned long long rchar, wchar;
+};
+
+struct monproc g_mon[MON_MAX_PROCS];
+int g_mon_count = 0;
+int g_mon_fds = 0;              // Descriptores abiertos en `g_mon`
+int g_mon_max_fds = -1;         // Como mucho, la mitad de RLIMIT_NOFILE
+
+
+// Lee el fichero `name` del proceso `pid` en `buf` usando el descriptor
+// `*fd`, que se abre la primera vez. Si ya hay demasiados descriptores
+// abiertos, se abre y se cierra en cada lectura. Devuelve los bytes leídos o
+// -1 si el proceso ya no existe.
+ssize_t mon_read(pid_t pid, int* fd, const char* name, char* buf, size_t size)
+{
+    char path[64];
+    int tmp = -1;
+    ssize_t n;
+
+    if (*fd < 0)
+    {
+        snprintf(path, sizeof(path), "/proc/%d/%s", pid, name);
+        if ((tmp = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+            return -1;
+        if (g_mon_fds < g_mon_max_fds)
+        {
+            // Lejos de los descriptores que usan las redirecciones
+            int high = fcntl(tmp, F_DUPFD_CLOEXEC, FD_INTERNAL);
+            if (high >= 0)
+            {
+                TRY( close(tmp) );
+                *fd = high;
+                tmp = -1;
+                g_mon_fds++;
+            }
+        }
+    }
+
+    while ((n = pread(tmp >= 0 ? tmp : *fd, buf, size - 1, 0)) < 0 && errno == EINTR)
+        ;
+    if (tmp >= 0)
+        TRY( close(tmp) );
+    if (n <= 0)
+        return -1;
+    buf[n] = 0;
+    return n;
+}
+
+
+void mon_close(struct monproc* e)
+{
+    int* fds[] = { &e->fd_stat, &e->fd_statm, &e->fd_io, &e->fd_children };
+
+    for (int i = 0; i < 4; i++)
+        if (*fds[i] >= 0)
+        {
+            TRY( close(*fds[i]) );
+            *fds[i] = -1;
+            g_mon_fds--;
+        }
+}
+
+
+// Devuelve la entrada de `pid`, creándola si no existe
+struct monproc* mon_entry(pid_t pid)
+{
+    struct monproc* e;
+
+    for (int i = 0; i < g_mon_count; i++)
+        if (g_mon[i].pid == pid)
+            return &g_mon[i];
+    if (g_mon_count == MON_MAX_PROCS)
+        return NULL;
+
+    e = &g_mon[g_mon_count++];
+    e->pid = pid;
+    e->fd_stat = e->fd_statm = e->fd_io = e->fd_children = -1;
+    e->ticks = 0;
+    e->sampled.tv_sec = 0;
+    e->sampled.tv_nsec = 0;
+    e->seen = 0;
+    return e;
+}
+
+
+// Lee una muestra de `e` y la acumula en `js`. Devuelve el número de hilos
+// del proceso o -1 si ya no existe.
+int mon_sample(struct monproc* e, struct jobstat* js)
+{
+    char buf[MON_BUF];
+    char state;
+    unsigned long long utime, stime, start, ticks, rss, rchar, wchar;
+    int threads;
+    struct timespec now;
+    long hz = sysconf(_SC_CLK_TCK);
+
+    if (mon_read(e->pid, &e->fd_stat, "stat", buf, sizeof(buf)) < 0)
+        return -1;
+    // El nombre va entre paréntesis y puede contener espacios
+    char* p = strrchr(buf, ')');
+    if (!p || sscanf(p + 1, " %c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu"
+                " %*d %*d %*d %*d %d %*d %llu", &state, &utime, &stime,
+                &threads, &start) != 5)
+        return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ticks = utime + stime;
+    double dt = (now.tv_sec - e->sampled.tv_sec) + (now.tv_nsec - e->sampled.tv_nsec) / 1e9;
+    if ((e->sampled.tv_sec == 0 && e->sampled.tv_nsec == 0) || dt < 10.0 / hz)
+    {
+        // Primera muestra (o demasiado cerca de la anterior para que la
+        // diferencia de ticks signifique algo): media desde que arrancó el
+        // proceso, como `ps`
+        struct timespec boot;
+        clock_gettime(CLOCK_BOOTTIME, &boot);
+        double alive = boot.tv_sec + boot.tv_nsec / 1e9 - (double) start / hz;
+        if (alive > 0)
+            js->cpu += 100.0 * ticks / hz / alive;
+    }
+    else if (ticks >= e->ticks)
+        js->cpu += 100.0 * (ticks - e->ticks) / hz / dt;
+    e->ticks = ticks;
+    e->sampled = now;
+
+    // El estado de la tarea es el más activo de sus procesos
+    if (js->nprocs == 0 || state == 'R' || (state == 'D' && js->state != 'R'))
+        js->state = state;
+    js->nprocs++;
+
+    if (mon_read(e->pid, &e->fd_statm, "statm", buf, sizeof(buf)) > 0 &&
+            sscanf(buf, "%*u %llu", &rss) == 1)
+        js->rss += rss * sysconf(_SC_PAGESIZE);
+    // `rchar` y `wchar` cuentan también las tuberías y la caché de páginas,
+    // que es lo que mueve la mayoría de órdenes de un shell
+    if (mon_read(e->pid, &e->fd_io, "io", buf, sizeof(buf)) > 0 &&
+            sscanf(buf, "rchar: %llu wchar: %llu", &rchar, &wchar) == 2)
+    {
+        js->rchar += rchar;
+        js->wchar += wchar;
+    }
+
+    return threads;
+}
+
+
+void mon_visit(pid_t pid, struct jobstat* js, int depth);
+
+
+// Visita los hijos de los procesos listados en `buf` (formato de
+// /proc/PID/task/TID/children)
+void mon_visit_list(char* buf, struct jobstat* js, int depth)
+{
+    char* end;
+
+    for (long child; (child = strtol(buf, &end, 10)) > 0; buf = end)
+        mon_visit(child, js, depth + 1);
+}
+
+
+// Acumula en `js` el proceso `pid` y todos sus descendientes
+void mon_visit(pid_t pid, struct jobstat* js, int depth)
+{
+    struct monproc* e;
+    char buf[MON_BUF];
+    int threads;
+
+    if (depth > 64 || (e = mon_entry(pid)) == NULL || e->seen)
+        return;
+
+    if ((threads = mon_sample(e, js)) < 0)
+    {
+        // Puede ser un PID reutilizado por otro proceso tras cerrar el
+        // anterior: se reabre una vez
+        mon_close(e);
+        e->sampled.tv_sec = e->sampled.tv_nsec = 0;
+        if ((threads = mon_sample(e, js)) < 0)
+            return;
+    }
+    e->seen = 1;
+
+    // Los hijos se listan por el hilo que los creó; casi siempre el principal
+    if (threads <= 1)
+    {
+        char name[48];
+        snprintf(name, sizeof(name), "task/%d/children", pid);
+        if (mon_read(pid, &e->fd_children, name, buf, sizeof(buf)) > 0)
+            mon_visit_list(buf, js, depth);
+        return;
+    }
+
+    char path[64];
+    DIR* dir;
+    struct dirent* d;
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    if ((dir = opendir(path)) == NULL)
+        return;
+    while ((d = readdir(dir)) != NULL)
+    {
+        int fd = -1;
+        char name[48];
+        if (d->d_name[0] == '.')
+            continue;
+        snprintf(name, sizeof(name), "task/%d/children", atoi(d->d_name));
+        if (mon_read(pid, &fd, name, buf, sizeof(buf)) > 0)
+            mon_visit_list(buf, js, depth);
+        if (fd >= 0)
+        {
+            TRY( close(fd) );
+            g_mon_fds--;
+        }
+    }
+    closedir(dir);
+}
+
+
+// Toma una muestra de cada tarea en ejecución y cierra los descriptores de
+// los procesos que ya no pertenecen a ninguna
+void mon_pass(struct jobstat js[MAX_PIDS])
+{
+    if (g_mon_max_fds < 0)
+    {
+        struct rlimit rl;
+        g_mon_max_fds = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY
+            ? rl.rlim_cur / 2 : 512;
+    }
+
+    for (int i = 0; i < g_mon_count; i++)
+        g_mon[i].seen = 0;
+    memset(js, 0, MAX_PIDS * sizeof(js[0]));
+    for (int i = 0; i < MAX_PIDS; i++)
+        if (processes[i] != -1)
+            mon_visit(processes[i], &js[i], 0);
+
+    for (int i = 0; i < g_mon_count; )
+    {
+        if (g_mon[i].seen)
+        {
+            i++;
+            continue;
+        }
+        mon_close(&g_mon[i]);
+        g_mon[i] = g_mon[--g_mon_count];
+    }
+}
+
+
+// Escribe `bytes` en `buf` con el múltiplo binario más adecuado
+char* format_bytes(char* buf, size_t size, unsigned long long bytes)
+{
+    const char* units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+    double value = bytes;
+    int unit = 0;
+
+    while (value >= 1024 && unit < 4)
+    {
+        value /= 1024;
+        unit++;
+    }
+    if (unit == 0)
+        snprintf(buf, size, "%llu B", bytes);
+    else
+        snprintf(buf, size, "%.1f %s", value, units[unit]);
+    return buf;
+}
+
+
+// Muestra el uso de recursos de las tareas en segundo plano. Con `interval`
+// mayor que 0 se repite cada `interval` segundos `count` veces (o hasta que
+// se pulse Intro o no queden tareas si `count` es 0).
+void run_bjobs_monitor(double interval, int count)
+{
+    struct jobstat js[MAX_PIDS];
+    char rss[16], rchar[16], wchar[16];
+    int clear = interval > 0 && isatty(STDOUT_FILENO);
+
+    loop_init();
+    for (int iter = 1; ; iter++)
+    {
+        int jobs = 0;
+
+        mon_pass(js);
+        if (clear)
+            printf("\033[H\033[2J");
+        else if (iter > 1)
+            putchar('\n');
+        printf("%-10s %3s %5s %6s %10s %10s %10s %9s\n",
+                "PID", "EST", "PROC", "%CPU", "RSS", "LEÍDO", "ESCRITO", "TIEMPO");
+        for (int i = 0; i < MAX_PIDS; i++)
+        {
+            if (processes[i] == -1 || js[i].nprocs == 0)
+                continue;
+            char pid[16];
+            snprintf(pid, sizeof(pid), "[%d]", processes[i]);
+            printf("%-10s %3c %5d %6.1f %10s %10s %10s %8.1fs\n",
+                    pid, js[i].state, js[i].nprocs, js[i].cpu,
+                    format_bytes(rss, sizeof(rss), js[i].rss),
+                    format_bytes(rchar, sizeof(rchar), js[i].rchar),
+                    format_bytes(wchar, sizeof(wchar), js[i].wchar),
+                    elapsed_since(&processes_start[i]));
+            jobs++;
+        }
+        fflush(stdout);
+
+        if (interval <= 0 || (count > 0 && iter >= count) || (jobs == 0 && !job_queue))
+            break;
+
+        // Espera al siguiente refresco recogiendo los hijos que terminen.
+        // SIGINT está bloqueada en el shell: el refresco se corta con Intro.
+        struct timespec start;
+        int stop = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (double left; !stop && (left = interval - elapsed_since(&start)) > 0; )
+        {
+            struct pollfd fds[2] = {
+                { .fd = g_sigfd, .events = POLLIN },
+                { .fd = g_interactive ? STDIN_FILENO : -1, .events = POLLIN },
+            };
+            if (poll(fds, 2, (int) (left * 1000) + 1) < 0 && errno != EINTR)
+                TRY( -1 );
+            if (fds[0].revents & POLLIN)
+                reap_children();
+            if (fds[1].revents & POLLIN)
+            {
+                char c;
+                while (read(STDIN_FILENO, &c, 1) == 1 && c != '\n')
+                    ;
+                stop = 1;
+            }
+        }
+        if (stop)
+            break;
+    }
+}
+
+
+void run_bjobs(struct execcmd * cmd){
+
+
+    int opt;
+    optind = 0;  // bug libreria getopt()
+    int k,h,q,r,m,count;
+    double interval;
+    k=0;h=0;q=0;r=0;m=0;count=0;interval=0;
+    while ((opt = getopt(cmd->argc, cmd->argv, "hkqrmi:c:j:o:P:")) != -1) {
+        switch (opt) {
+            case 'm':
+                m=1;
+                break;
+            case 'i':
+                if((interval = atof(optarg)) <= 0){
+                    printf("bjobs: Opción -i no válida, debe ser mayor que 0\n");
+                    return;
+                }
+                break;
+            case 'c':
+                if((count = atoi(optarg)) < 1){
+                    printf("bjobs: Opción -c no válida, debe ser mayor que 0\n");
+                    return;
+                }
+                break;
+            case 'h':
+                h=1;
+                break;
+            case 'k':
+                k=1;
+                break;
+            case 'q':
+                q=1;
+                break;
+            case 'r':
+                r=1;
+                break;
+            case 'j':
+                if(atoi(optarg) < 1 || atoi(optarg) > MAX_PIDS){
+                    printf("bjobs: Opción -j no válida (1-%d)\n",MAX_PIDS);
+                    return;
+                }
+                g_max_jobs = atoi(optarg);
+                break;
+            case 'o':
+                if(!strcmp(optarg,"fifo")){
+                    g_job_policy = JOB_FIFO;
+                }else if(!strcmp(optarg,"prio")){
+                    g_job_policy = JOB_PRIO;
+                }else{
+                    printf("bjobs: Opción -o no válida, debe ser fifo o prio\n");
+                    return;
+                }
+                break;
+            case 'P':
+                g_job_prio = atoi(optarg);
+                break;
+            default:
+                return;
+        }
+    }
+    
+    if (h){
+        printf("Uso : bjobs [-k] [-q] [-r] [-m [-i SEG] [-c N]] [-j NJOBS] [-o fifo|prio] [-P PRIO] [-h]\n");
+        printf("      Opciones :\n");
+        printf("      -k Mata todos los procesos en segundo plano y vacía la cola.\n");
+        printf("      -q Muestra las tareas en cola y el tiempo que llevan esperando.\n");
+        printf("      -r Muestra las tareas en ejecución y el tiempo que llevan ejecutándose.\n");
+        printf("      -m Muestra el estado, %%CPU, memoria residente y bytes leídos y escritos\n");
+        printf("         de cada tarea (sumando todos sus procesos).\n");
+        printf("      -i Con -m, refresca cada SEG segundos hasta pulsar Intro.\n");
+        printf("      -c Con -m, número de refrescos (cada segundo si no se indica -i).\n");
+        printf("      -j Número máximo de tareas en ejecución simultánea (actual: %d).\n",g_max_jobs);
+        printf("      -o Orden de la cola: fifo o prio (por prioridad).\n");
+        printf("      -P Prioridad de las siguientes tareas encoladas (actual: %d).\n",g_job_prio);
+        printf("      -h Ayuda\n");
+    }else if (k){
+
+         for(int i = 0;i<MAX_PIDS;i++){
+            if(processes[i]!= -1){
+                TRY(kill(processes[i],SIGTERM));
+            }
+        }
+        struct job* job;
+        while((job = dequeue_job()) != NULL)
+            free_job(job);
+    }else if (m){
+        if(count && !interval)
+            interval = 1;
+        run_bjobs_monitor(interval,count);
+    }else if (q || r){
+        if(r){
+            for(int i = 0;i<MAX_PIDS;i++){
+                if(processes[i] != -1){
+                    printf("[%d] ejecutando %.1fs\n",processes[i],
+                            elapsed_since(&processes_start[i]));
+                }
+            }
+        }
+        if(q){
+            for(struct job* job = job_queue; job; job = job->next){
+                printf("[en cola #%d] prio %d esperando %.1fs\n",job->id,
+                        job->prio,elapsed_since(&job->queued));
+            }
+        }
+    }else if (optind == cmd->argc && cmd->argc == 1){
+        // Aqui enviar procesos en segundo plano activos
+        for(int i = 0;i<MAX_PIDS;i++){
+            if(processes[i] != -1){
+                printf("[%d]\n",processes[i]);
+            }
+        }
+    }
+
+    
+    optind = 0;
+
+
+
+}
+
+void run_pipesz(struct execcmd * cmd){
+    int opt;
+    optind = 1;
+
+    while ((opt = getopt(cmd->argc, cmd->argv, "h")) != -1) {
+        switch (opt) {
+            case 'h':
+                printf("Uso : pipesz [-h] [BYTES|auto]\n");
+                printf("      Capacidad de las tuberías de las siguientes órdenes.\n");
+                printf("      BYTES admite los sufijos K y M; 0 deja la del sistema.\n");
+                printf("      auto usa /proc/sys/fs/pipe-max-size (máximo %d) sin agotar\n",MAX_PIPE_SIZE);
+                printf("      /proc/sys/fs/pipe-user-pages-soft.\n");
+                printf("      -h Ayuda\n");
+                optind = 1;
+                return;
+            default:
+                optind = 1;
+                return;
+        }
+    }
+
+    if (optind < cmd->argc) {
+        char* end;
+        long size;
+        if (!strcmp(cmd->argv[optind],"auto")) {
+            size = auto_pipe_size();
+        } else {
+            size = strtol(cmd->argv[optind],&end,10);
+            if (*end == 'K' || *end == 'k')
+                size <<= 10, end++;
+            else if (*end == 'M' || *end == 'm')
+                size <<= 20, end++;
+            if (*end || size < 0 || size > INT_MAX) {
+                printf("pipesz: Tamaño no válido '%s'\n",cmd->argv[optind]);
+                optind = 1;
+                return;
+            }
+        }
+        g_pipe_size = size;
+    } else {
+        printf("pipesz: %d\n",g_pipe_size);
+    }
+    optind = 1;
+}
+
+/******************************************************************************
+ * Historial persistente
+ ******************************************************************************/
+
+
+// Cada orden se añade, con una sola escritura `O_APPEND`, al fichero de
+// historial (`SIMPLESH_HISTFILE` o `~/.simplesh_history`), compartido por
+// todas las instancias de `simplesh`. Cada línea es un registro:
+//
+//     INICIO<TAB>ESTADO<TAB>DURACIÓN_MS<TAB>ORDEN
+//
+// con el instante de inicio (segundos desde 1970), el estado de terminación
+// y la duración de la orden.
+//
+// El fichero no se lee al arrancar. La primera búsqueda lo proyecta con
+// `mmap` y construye un índice con el principio de cada registro; las
+// siguientes solo indexan lo que se haya añadido desde entonces. Para buscar
+// por prefijo se mantiene además una permutación de los registros ordenada
+// por la orden, en la que se busca con búsqueda binaria.
+
+#define HIST_FILE ".simplesh_history"
+
+int g_hist_fd = -1;
+int g_hist_disabled = 0;
+
+struct hist_entry {
+    size_t rec;             // Desplazamiento del registro
+    size_t cmd;             // Desplazamiento de la orden
+    size_t len;             // Longitud de la orden
+};
+
+struct hist_index {
+    int fd;
+    char* map;
+    size_t mapped;          // Bytes proyectados
+    size_t indexed;         // Bytes indexados (registros completos)
+    struct hist_entry* entries;
+    size_t count, cap;
+    size_t* sorted;         // Números de registro ordenados por la orden
+    size_t nsorted;         // Registros incluidos en `sorted`
+};
+
+struct hist_index g_hist = { .fd = -1 };
+
+
+// Devuelve la ruta del fichero de historial o NULL si no hay
+const char* hist_path()
+{
+    static char path[PATH_MAX];
+    const char* home;
+
+    if (getenv("SIMPLESH_HISTFILE"))
+        return getenv("SIMPLESH_HISTFILE");
+    if ((home = getenv("HOME")) == NULL)
+        return NULL;
+    snprintf(path, sizeof(path), "%s/%s", home, HIST_FILE);
+    return path;
+}
+
+
+// `hist_append` añade `line` al historial con su estado de terminación y su
+// duración
+void hist_append(const char* line, time_t start, int status, double seconds)
+{
+    const char* path;
+
+    if (line[strspn(line, " \t")] == 0 || g_hist_disabled)
+        return;
+
+    if (g_hist_fd < 0)
+    {
+        int fd;
+        if ((path = hist_path()) == NULL ||
+                (fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) < 0)
+        {
+            g_hist_disabled = 1;
+            return;
+        }
+        g_hist_fd = fd_internal(fd);
+    }
+
+    size_t size = strlen(line) + 64;
+    char record[size];
+    int len = snprintf(record, size, "%lld\t%d\t%lld\t%s\n", (long long) start,
+            status, (long long) (seconds * 1000), line);
+    if (write_all(g_hist_fd, record, len) < 0)
+        perror("hist_append: write");
+}
+
+
+// Orden del registro número `n` y su longitud
+const char* hist_cmd(size_t n, size_t* len)
+{
+    *len = g_hist.entries[n].len;
+    return g_hist.map + g_hist.entries[n].cmd;
+}
+
+
+// Compara dos registros (por su número) según su orden; a igual orden, el
+// más antiguo primero
+int hist_cmp(const void* a, const void* b)
+{
+    size_t ia = *(const size_t*) a, ib = *(const size_t*) b, la, lb;
+    const char* ca = hist_cmd(ia, &la);
+    const char* cb = hist_cmd(ib, &lb);
+    int c = memcmp(ca, cb, la < lb ? la : lb);
+
+    if (c == 0 && la != lb)
+        c = la < lb ? -1 : 1;
+    return c ? c : (ia > ib) - (ia < ib);
+}
+
+
+int cmp_size(const void* a, const void* b)
+{
+    size_t x = *(const size_t*) a, y = *(const size_t*) b;
+    return (x > y) - (x < y);
+}
+
+
+// `hist_load` proyecta el fichero de historial e indexa los registros
+// nuevos. Devuelve -1 si no hay historial.
+int hist_load()
+{
+    struct stat st;
+    const char* path;
+
+    if (g_hist.fd < 0)
+    {
+        int fd;
+        if ((path = hist_path()) == NULL || (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+            return -1;
+        g_hist.fd = fd_internal(fd);
+    }
+
+    TRY( fstat(g_hist.fd, &st) );
+    if ((size_t) st.st_size > g_hist.mapped)
+    {
+        if (g_hist.map)
+            TRY( munmap(g_hist.map, g_hist.mapped) );
+        if ((g_hist.map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, g_hist.fd, 0)) == MAP_FAILED)
+        {
+            perror("hist_load: mmap");
+            g_hist.map = NULL;
+            g_hist.mapped = g_hist.indexed = g_hist.count = g_hist.nsorted = 0;
+            return -1;
+        }
+        g_hist.mapped = st.st_size;
+    }
+
+    // Solo se indexan registros completos: otra instancia puede estar
+    // escribiendo el último
+    const char* p = g_hist.map + g_hist.indexed;
+    const char* end = g_hist.map + g_hist.mapped;
+    const char* nl;
+    while (p < end && (nl = memchr(p, '\n', end - p)) != NULL)
+    {
+        if (g_hist.count == g_hist.cap)
+        {
+            g_hist.cap = g_hist.cap ? g_hist.cap * 2 : 4096;
+            if ((g_hist.entries = realloc(g_hist.entries, g_hist.cap * sizeof(*g_hist.entries))) == NULL)
+            {
+                perror("hist_load: realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        // La orden va tras el tercer tabulador
+        struct hist_entry* e = &g_hist.entries[g_hist.count++];
+        const char* cmd = p;
+        for (int tabs = 0; tabs < 3 && cmd < nl; cmd++)
+            if (*cmd == '\t')
+                tabs++;
+        e->rec = p - g_hist.map;
+        e->cmd = cmd - g_hist.map;
+        e->len = nl - cmd;
+        p = nl + 1;
+    }
+    g_hist.indexed = p - g_hist.map;
+
+    return 0;
+}
+
+
+// `hist_sort` incorpora a la permutación ordenada los registros indexados
+// desde la última vez: se ordenan solo los nuevos y se mezclan con el resto
+void hist_sort()
+{
+    size_t old = g_hist.nsorted, count = g_hist.count;
+    size_t *added, *out;
+
+    if (old == count)
+        return;
+
+    if ((added = malloc((count - old) * sizeof(size_t))) == NULL ||
+            (out = malloc(count * sizeof(size_t))) == NULL)
+    {
+        perror("hist_sort: malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t n = old; n < count; n++)
+        added[n - old] = n;
+    qsort(added, count - old, sizeof(size_t), hist_cmp);
+
+    size_t i = 0, j = 0, k = 0;
+    while (i < old && j < count - old)
+        out[k++] = hist_cmp(&g_hist.sorted[i], &added[j]) <= 0 ? g_hist.sorted[i++] : added[j++];
+    while (i < old)
+        out[k++] = g_hist.sorted[i++];
+    while (j < count - old)
+        out[k++] = added[j++];
+
+    free(added);
+    free(g_hist.sorted);
+    g_hist.sorted = out;
+    g_hist.nsorted = count;
+}
+
+
+// Muestra el registro número `n`
+void hist_print(size_t n)
+{
+    long long start, ms;
+    int status;
+    size_t len;
+    const char* cmd = hist_cmd(n, &len);
+    char date[32] = "?";
+
+    // La proyección no termina en NULL: la cabecera se copia antes de
+    // analizarla
+    char head[64];
+    size_t hlen = g_hist.entries[n].cmd - g_hist.entries[n].rec;
+    if (hlen >= sizeof(head))
+        hlen = sizeof(head) - 1;
+    memcpy(head, g_hist.map + g_hist.entries[n].rec, hlen);
+    head[hlen] = 0;
+
+    if (sscanf(head, "%lld\t%d\t%lld", &start, &status, &ms) == 3)
+    {
+        time_t t = start;
+        struct tm tm;
+        strftime(date, sizeof(date), "%F %T", localtime_r(&t, &tm));
+    }
+    else
+        status = -1, ms = 0;
+
+    printf("%6zu  %s  %3d  %8.3fs  %.*s\n", n + 1, date, status, ms / 1000.0, (int) len, cmd);
+}
+
+
+// history [-h] [-n N] [-p PREFIJO | -s CADENA]
+void run_history(struct execcmd * cmd)
+{
+    int opt;
+    long last = -1;
+    const char* prefix = NULL;
+    const char* substr = NULL;
+    size_t* match = NULL;
+    size_t nmatch = 0, cap = 0;
+
+    optind = 1;
+    while ((opt = getopt(cmd->argc, cmd->argv, "hn:p:s:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                last = atol(optarg);
+                break;
+            case 'p':
+                prefix = optarg;
+                break;
+            case 's':
+                substr = optarg;
+                break;
+            case 'h':
+            default:
+                printf("Uso: history [-h] [-n N] [-p PREFIJO | -s CADENA]\n"
+                       "\tOpción -n: muestra solo los N últimos registros\n"
+                       "\tOpción -p: registros cuya orden empieza por PREFIJO\n"
+                       "\tOpción -s: registros cuya orden contiene CADENA\n");
+                return;
+        }
+    }
+
+    if (hist_load() < 0)
+        return;
+
+    if (prefix)
+    {
+        // Búsqueda binaria del primer registro con el prefijo
+        size_t plen = strlen(prefix), lo = 0, hi = g_hist.count, len;
+
+        hist_sort();
+        while (lo < hi)
+        {
+            size_t mid = (lo + hi) / 2;
+            const char* c = hist_cmd(g_hist.sorted[mid], &len);
+            int r = memcmp(c, prefix, len < plen ? len : plen);
+            if (r < 0 || (r == 0 && len < plen))
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        for (hi = lo; hi < g_hist.nsorted; hi++)
+        {
+            const char* c = hist_cmd(g_hist.sorted[hi], &len);
+            if (len < plen || memcmp(c, prefix, plen))
+                break;
+        }
+
+        // Se muestran en orden cronológico
+        nmatch = hi - lo;
+        if ((match = malloc((nmatch + 1) * sizeof(size_t))) == NULL)
+        {
+            perror("run_history: malloc");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(match, g_hist.sorted + lo, nmatch * sizeof(size_t));
+        qsort(match, nmatch, sizeof(size_t), cmp_size);
+    }
+    else
+    {
+        // Búsqueda lineal sobre la proyección, de la más reciente hacia
+        // atrás para poder parar en cuanto hay `last` resultados
+        size_t slen = substr ? strlen(substr) : 0, len;
+
+        for (size_t n = g_hist.count; n-- > 0 && (last < 0 || nmatch < (size_t) last); )
+        {
+            const char* c = hist_cmd(n, &len);
+            if (substr && !memmem(c, len, substr, slen))
+                continue;
+            if (nmatch == cap)
+            {
+                cap = cap ? cap * 2 : 256;
+                if ((match = realloc(match, cap * sizeof(size_t))) == NULL)
+                {
+                    perror("run_history: realloc");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            match[nmatch++] = n;
+        }
+        for (size_t i = 0; i < nmatch / 2; i++)
+        {
+            size_t t = match[i];
+            match[i] = match[nmatch - 1 - i];
+            match[nmatch - 1 - i] = t;
+        }
+    }
+
+    for (size_t i = last >= 0 && (size_t) last < nmatch ? nmatch - last : 0; i < nmatch; i++)
+        hist_print(match[i]);
+
+    free(match);
+    fflush(stdout);
+}
+
+
+/******************************************************************************
+ * Afinidad de CPU y ubicación de las etapas de las tuberías
+ ******************************************************************************/
+
+
+// La topología se lee de /sys/devices/system/cpu: para cada CPU permitida al
+// shell se anota su nodo NUMA, el grupo de CPUs con el que comparte la última
+// caché (LLC) y su núcleo físico. Con ella se calculan dos órdenes de CPUs:
+//
+// - Compacto: agrupa las CPUs por nodo y LLC y, dentro de cada LLC, recorre
+//   primero un hilo de cada núcleo. Las etapas consecutivas de una tubería
+//   ocupan CPUs consecutivas de este orden, así que comparten la caché por la
+//   que pasan los datos sin competir por el mismo núcleo.
+// - Disperso: alterna nodos, LLCs y núcleos. Lo usan los trabajadores de
+//   `psplit -p`, que no se comunican entre sí y se benefician de tener cada
+//   uno su caché y su ancho de banda de memoria.
+//
+// Con la ubicación desactivada (por defecto) los hijos heredan sin más la
+// afinidad del shell.
+
+#define SYS_CPU "/sys/devices/system/cpu"
+#define SYS_NODE "/sys/devices/system/node"
+
+struct cpu_topo {
+    int cpu;
+    int node;
+    int llc;        // Primera CPU del grupo que comparte la última caché
+    int core;       // Primera CPU del núcleo físico
+    int smt;        // Posición de la CPU entre los hilos de su núcleo
+    int llc_rank;   // Posición de la LLC dentro del nodo
+    int core_rank;  // Posición del núcleo dentro de la LLC
+};
+
+struct cpu_topo g_topo[CPU_SETSIZE];
+int g_ncpus = -1;                   // -1 hasta leer la topología
+int g_compact[CPU_SETSIZE];         // Índices de `g_topo` en orden compacto
+int g_spread[CPU_SETSIZE];          // Índices de `g_topo` en orden disperso
+
+
+// Lee la primera línea del fichero `path` en `buf`. Devuelve -1 si no existe.
+int read_sysfs(const char* path, char* buf, size_t size)
+{
+    int fd;
+    ssize_t n;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    n = read(fd, buf, size - 1);
+    TRY( close(fd) );
+    if (n <= 0)
+        return -1;
+    buf[n] = 0;
+    buf[strcspn(buf, "\n")] = 0;
+    return 0;
+}
+
+
+// Convierte una lista de CPUs como "0-3,8,10-11" en un `cpu_set_t`
+int parse_cpulist(const char* s, cpu_set_t* set)
+{
+    char* end;
+
+    CPU_ZERO(set);
+    while (*s)
+    {
+        long first = strtol(s, &end, 10), last = first;
+        if (end == s || first < 0)
+            return -1;
+        if (*end == '-')
+        {
+            s = end + 1;
+            last = strtol(s, &end, 10);
+            if (end == s || last < first)
+                return -1;
+        }
+        if (last >= CPU_SETSIZE)
+            return -1;
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+        if (*end == ',')
+            end++;
+        else if (*end && !IS_SPACE(*end))
+            return -1;
+        for (s = end; *s && IS_SPACE(*s); s++)
+            ;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+
+// Escribe `set` en `buf` con el formato de `parse_cpulist`
+char* format_cpulist(const cpu_set_t* set, char* buf, size_t size)
+{
+    size_t len = 0;
+
+    buf[0] = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++)
+    {
+        if (!CPU_ISSET(cpu, set))
+            continue;
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set))
+            last++;
+        if (last == cpu)
+            len += snprintf(buf + len, size - len, "%s%d", len ? "," : "", cpu);
+        else
+            len += snprintf(buf + len, size - len, "%s%d-%d", len ? "," : "", cpu, last);
+        cpu = last;
+    }
+    return buf;
+}
+
+
+// Primera CPU de la lista del fichero `path` o -1
+int first_cpu(const char* path)
+{
+    char buf[256];
+    cpu_set_t set;
+
+    if (read_sysfs(path, buf, sizeof(buf)) < 0 || parse_cpulist(buf, &set) < 0)
+        return -1;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &set))
+            return cpu;
+    return -1;
+}
+
+
+int cmp_compact(const void* a, const void* b)
+{
+    const struct cpu_topo* x = &g_topo[*(const int*) a];
+    const struct cpu_topo* y = &g_topo[*(const int*) b];
+
+    if (x->node != y->node) return x->node - y->node;
+    if (x->llc != y->llc) return x->llc - y->llc;
+    if (x->smt != y->smt) return x->smt - y->smt;
+    if (x->core != y->core) return x->core - y->core;
+    return x->cpu - y->cpu;
+}
+
+
+int cmp_spread(const void* a, const void* b)
+{
+    const struct cpu_topo* x = &g_topo[*(const int*) a];
+    const struct cpu_topo* y = &g_topo[*(const int*) b];
+
+    if (x->smt != y->smt) return x->smt - y->smt;
+    if (x->core_rank != y->core_rank) return x->core_rank - y->core_rank;
+    if (x->llc_rank != y->llc_rank) return x->llc_rank - y->llc_rank;
+    if (x->node != y->node) return x->node - y->node;
+    return x->cpu - y->cpu;
+}
+
+
+// Lee la topología de las CPUs en las que puede ejecutarse el shell
+void topo_load()
+{
+    static int node_of[CPU_SETSIZE];
+    cpu_set_t allowed, set;
+    char path[128], buf[256];
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+    {
+        perror("sched_getaffinity");
+        g_ncpus = 0;
+        return;
+    }
+
+    // Sin soporte NUMA todas las CPUs son del nodo 0
+    memset(node_of, 0, sizeof(node_of));
+    if (read_sysfs(SYS_NODE "/online", buf, sizeof(buf)) == 0 && parse_cpulist(buf, &set) == 0)
+        for (int node = 0; node < CPU_SETSIZE; node++)
+        {
+            cpu_set_t cpus;
+            if (!CPU_ISSET(node, &set))
+                continue;
+            snprintf(path, sizeof(path), SYS_NODE "/node%d/cpulist", node);
+            if (read_sysfs(path, buf, sizeof(buf)) == 0 && parse_cpulist(buf, &cpus) == 0)
+                for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                    if (CPU_ISSET(cpu, &cpus))
+                        node_of[cpu] = node;
+        }
+
+    g_ncpus = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        struct cpu_topo* t = &g_topo[g_ncpus];
+        int level = 0;
+
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+        t->cpu = cpu;
+        t->node = node_of[cpu];
+
+        // La LLC es la caché de datos o unificada de mayor nivel
+        t->llc = t->node == 0 ? 0 : -1;
+        for (int index = 0; ; index++)
+        {
+            int l;
+            snprintf(path, sizeof(path), SYS_CPU "/cpu%d/cache/index%d/level", cpu, index);
+            if (read_sysfs(path, buf, sizeof(buf)) < 0)
+                break;
+            l = atoi(buf);
+            snprintf(path, sizeof(path), SYS_CPU "/cpu%d/cache/index%d/type", cpu, index);
+            if (l <= level || (read_sysfs(path, buf, sizeof(buf)) == 0 && !strcmp(buf, "Instruction")))
+                continue;
+            snprintf(path, sizeof(path), SYS_CPU "/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+            level = l;
+            t->llc = first_cpu(path);
+        }
+        if (t->llc < 0)
+            t->llc = cpu;
+
+        snprintf(path, sizeof(path), SYS_CPU "/cpu%d/topology/thread_siblings_list", cpu);
+        t->core = cpu;
+        t->smt = 0;
+        if (read_sysfs(path, buf, sizeof(buf)) == 0 && parse_cpulist(buf, &set) == 0)
+        {
+            t->core = first_cpu(path);
+            for (int sib = 0; sib < cpu; sib++)
+                if (CPU_ISSET(sib, &set))
+                    t->smt++;
+        }
+        g_ncpus++;
+    }
+
+    for (int i = 0; i < g_ncpus; i++)
+        g_compact[i] = i;
+    qsort(g_compact, g_ncpus, sizeof(int), cmp_compact);
+
+    // Posiciones de cada LLC en su nodo y de cada núcleo en su LLC para el
+    // orden disperso
+    for (int i = 0, llc_rank = 0, node = -1, llc = -1; i < g_ncpus; i++)
+    {
+        struct cpu_topo* t = &g_topo[g_compact[i]];
+        if (t->node != node)
+            llc_rank = -1;
+        if (t->node != node || t->llc != llc)
+            llc_rank++;
+        node = t->node;
+        llc = t->llc;
+        t->llc_rank = llc_rank;
+    }
+    for (int i = 0; i < g_ncpus; i++)
+    {
+        struct cpu_topo* t = &g_topo[i];
+        t->core_rank = 0;
+        for (int j = 0; j < g_ncpus; j++)
+            if (g_topo[j].llc == t->llc && g_topo[j].node == t->node &&
+                    g_topo[j].smt == 0 && g_topo[j].core < t->core)
+                t->core_rank++;
+    }
+    for (int i = 0; i < g_ncpus; i++)
+        g_spread[i] = i;
+    qsort(g_spread, g_ncpus, sizeof(int), cmp_spread);
+}
+
+
+// Fija el proceso actual a la CPU `cpu`. Es solo una mejora: si falla (p. ej.
+// porque un `cpuset` la ha retirado) se sigue con la afinidad heredada.
+void pin_to_cpu(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+        DPRINTF(DBG_TRACE, "sched_setaffinity %d: %s\n", cpu, strerror(errno));
+}
+
+
+// Devuelve 1 si la posición `i` del orden compacto empieza una nueva LLC
+int llc_starts(int i)
+{
+    return i == 0 || g_topo[g_compact[i]].llc != g_topo[g_compact[i - 1]].llc ||
+        g_topo[g_compact[i]].node != g_topo[g_compact[i - 1]].node;
+}
+
+
+// Posición en el orden compacto en la que empieza una nueva tubería: el
+// principio de la siguiente LLC, para que tuberías simultáneas no compartan
+// caché mientras haya LLCs libres
+int place_pipeline()
+{
+    int ngroups = 0, target;
+
+    if (g_ncpus < 0)
+        topo_load();
+    for (int i = 0; i < g_ncpus; i++)
+        ngroups += llc_starts(i);
+    if (ngroups == 0)
+        return 0;
+
+    target = g_place_next++ % ngroups;
+    for (int i = 0; i < g_ncpus; i++)
+        if (llc_starts(i) && target-- == 0)
+            return i;
+    return 0;
+}
+
+
+// Fija la etapa `stage` de la tubería que empieza en `base`
+void place_stage(int base, int stage)
+{
+    if (g_ncpus > 0)
+        pin_to_cpu(g_topo[g_compact[(base + stage) % g_ncpus]].cpu);
+}
+
+
+// Fija el trabajador `worker` de `psplit -p`
+void place_worker(int worker)
+{
+    if (g_ncpus < 0)
+        topo_load();
+    if (g_ncpus > 0)
+        pin_to_cpu(g_topo[g_spread[worker % g_ncpus]].cpu);
+}
+
+
+// Muestra los grupos de CPUs que comparten LLC y los dos órdenes
+void print_topology()
+{
+    char list[1024];
+
+    if (g_ncpus < 0)
+        topo_load();
+    for (int i = 0; i < g_ncpus; )
+    {
+        struct cpu_topo* t = &g_topo[g_compact[i]];
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        do
+            CPU_SET(g_topo[g_compact[i++]].cpu, &set);
+        while (i < g_ncpus && !llc_starts(i));
+        printf("nodo %d, LLC %d: CPUs %s\n", t->node, t->llc,
+                format_cpulist(&set, list, sizeof(list)));
+    }
+    printf("orden compacto (tuberías):");
+    for (int i = 0; i < g_ncpus; i++)
+        printf(" %d", g_topo[g_compact[i]].cpu);
+    printf("\norden disperso (psplit -p):");
+    for (int i = 0; i < g_ncpus; i++)
+        printf(" %d", g_topo[g_spread[i]].cpu);
+    printf("\n");
+}
+
+
+// affinity [-h] [-t] [-P on|off] [-c LISTA [ORDEN [ARG]...]]
+void run_affinity(struct execcmd * cmd)
+{
+    int opt, topology = 0;
+    const char* list = NULL;
+    cpu_set_t set;
+    char buf[1024];
+
+    while ((opt = getopt(options_end(cmd->argc, cmd->argv, "htP:c:"), cmd->argv, "htP:c:")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+                topology = 1;
+                break;
+            case 'P':
+                if (!strcmp(optarg, "on"))
+                {
+                    g_placement = 1;
+                    topo_load();
+                }
+                else if (!strcmp(optarg, "off"))
+                    g_placement = 0;
+                else
+                {
+                    printf("affinity: Opción -P no válida, debe ser on u off\n");
+                    return;
+                }
+                break;
+            case 'c':
+                list = optarg;
+                break;
+            case 'h':
+            default:
+                printf("Uso: affinity [-h] [-t] [-P on|off] [-c LISTA [ORDEN [ARG]...]]\n"
+                       "\tSin opciones muestra las CPUs en las que se ejecuta el shell\n"
+                       "\tOpción -c: ejecuta ORDEN en las CPUs de LISTA (p. ej. 0-3,8);\n"
+                       "\t           sin ORDEN, cambia la afinidad del propio shell\n"
+                       "\tOpción -P: fija las etapas de las tuberías a núcleos que\n"
+                       "\t           comparten caché y reparte los trabajadores de\n"
+                       "\t           psplit -p entre núcleos y nodos (actual: %s)\n"
+                       "\tOpción -t: muestra la topología de las CPUs\n",
+                       g_placement ? "on" : "off");
+                return;
+        }
+    }
+
+    if (list && parse_cpulist(list, &set) < 0)
+    {
+        printf("affinity: Lista de CPUs no válida: %s\n", list);
+        return;
+    }
+
+    if (list && optind < cmd->argc)
+    {
+        pid_t pid;
+
+        if ((pid = fork_or_panic("fork affinity")) == 0)
+        {
+            if (sched_setaffinity(0, sizeof(set), &set) < 0)
+            {
+                perror("affinity: sched_setaffinity");
+                exit(EXIT_FAILURE);
+            }
+            // La ubicación automática no debe deshacer la afinidad pedida
+            g_placement = 0;
+            exec_argv_tail(cmd, optind);
+        }
+        set_status(wait_child(pid));
+        return;
+    }
+
+    if (list)
+    {
+        if (sched_setaffinity(0, sizeof(set), &set) < 0)
+        {
+            perror("affinity: sched_setaffinity");
+            g_status = 1;
+            return;
+        }
+        // Las órdenes de CPUs solo incluyen las permitidas
+        topo_load();
+    }
+
+    if (topology)
+        print_topology();
+    else if (!list && sched_getaffinity(0, sizeof(set), &set) == 0)
+        printf("afinidad: %s (ubicación %s)\n", format_cpulist(&set, buf, sizeof(buf)),
+                g_placement ? "on" : "off");
+}
+
+
+/******************************************************************************
+ * Clases de prioridad de las tareas en segundo plano
+ ******************************************************************************/
+
+
+// Una clase de prioridad reúne el valor `nice`, la clase y el nivel de E/S de
+// `ioprio_set` y la política de planificación (SCHED_OTHER, SCHED_BATCH o
+// SCHED_IDLE). Las tareas en segundo plano (y, con `bclass -w on`, los
+// trabajadores de `psplit -p`) la aplican nada más crearse, antes de ejecutar
+// nada. Las tres llamadas actúan sobre un único hilo, así que para cambiar la
+// clase de una tarea ya en marcha se recorren todos los hilos de todos los
+// procesos de su árbol.
+
+// glibc no incluye envoltorio de `ioprio_set` (véase linux/ioprio.h)
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_PRIO_VALUE(class, level) (((class) << IOPRIO_CLASS_SHIFT) | (level))
+
+const char* ioprio_names[] = { "none", "rt", "be", "idle" };
+
+
+// Aplica la clase `pc` al hilo `tid` (0 para el hilo actual). Devuelve -1 si
+// alguna llamada falla, tras informar de ella.
+int apply_prio_class(pid_t tid, const struct prio_class* pc)
+{
+    int rc = 0;
+
+    if (pc->policy != PRIO_KEEP)
+    {
+        struct sched_param param = { .sched_priority = 0 };
+        if (sched_setscheduler(tid, pc->policy, &param) < 0)
+        {
+            fprintf(stderr, "bclass: %d: sched_setscheduler: %s\n", tid, strerror(errno));
+            rc = -1;
+        }
+    }
+    if (pc->nice != PRIO_KEEP && setpriority(PRIO_PROCESS, tid, pc->nice) < 0)
+    {
+        fprintf(stderr, "bclass: %d: setpriority: %s\n", tid, strerror(errno));
+        rc = -1;
+    }
+    if (pc->ioclass != PRIO_KEEP && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid,
+                IOPRIO_PRIO_VALUE(pc->ioclass, pc->iolevel)) < 0)
+    {
+        fprintf(stderr, "bclass: %d: ioprio_set: %s\n", tid, strerror(errno));
+        rc = -1;
+    }
+    return rc;
+}
+
+
+// Aplica la clase `pc` a todos los hilos del proceso `pid` y de sus
+// descendientes
+int apply_prio_class_tree(pid_t pid, const struct prio_class* pc, int depth)
+{
+    char path[64], buf[4096];
+    DIR* dir;
+    struct dirent* d;
+    int rc = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    if (depth > 64 || (dir = opendir(path)) == NULL)
+        return -1;
+    while ((d = readdir(dir)) != NULL)
+    {
+        pid_t tid = atoi(d->d_name);
+        char* p = buf;
+        if (tid <= 0)
+            continue;
+        if (apply_prio_class(tid, pc) < 0)
+            rc = -1;
+        snprintf(path, sizeof(path), "/proc/%d/task/%d/children", pid, tid);
+        if (read_sysfs(path, buf, sizeof(buf)) < 0)
+            continue;
+        for (long child; (child = strtol(p, &p, 10)) > 0; )
+            if (apply_prio_class_tree(child, pc, depth + 1) < 0)
+                rc = -1;
+    }
+    closedir(dir);
+    return rc;
+}
+
+
+// Escribe la clase `pc` en `buf`
+char* format_prio_class(const struct prio_class* pc, char* buf, size_t size)
+{
+    char nice[16], io[16];
+
+    if (pc->nice == PRIO_KEEP)
+        strcpy(nice, "=");
+    else
+        snprintf(nice, sizeof(nice), "%d", pc->nice);
+    if (pc->ioclass == PRIO_KEEP)
+        strcpy(io, "=");
+    else if (pc->ioclass == 1 || pc->ioclass == 2)
+        snprintf(io, sizeof(io), "%s:%d", ioprio_names[pc->ioclass], pc->iolevel);
+    else
+        snprintf(io, sizeof(io), "%s", ioprio_names[pc->ioclass]);
+
+    snprintf(buf, size, "nice %s, E/S %s, planificación %s", nice, io,
+            pc->policy == PRIO_KEEP ? "=" :
+            pc->policy == SCHED_BATCH ? "batch" :
+            pc->policy == SCHED_IDLE ? "idle" : "normal");
+    return buf;
+}
+
+
+// Clase actual del proceso `pid`
+int get_prio_class(pid_t pid, struct prio_class* pc)
+{
+    long io;
+
+    errno = 0;
+    pc->nice = getpriority(PRIO_PROCESS, pid);
+    if (errno != 0 || (pc->policy = sched_getscheduler(pid)) < 0 ||
+            (io = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, pid)) < 0)
+        return -1;
+    pc->policy &= ~SCHED_RESET_ON_FORK;
+    pc->ioclass = io >> IOPRIO_CLASS_SHIFT;
+    pc->iolevel = io & ((1 << IOPRIO_CLASS_SHIFT) - 1);
+    if (pc->ioclass > 3)
+        pc->ioclass = 0;
+    return 0;
+}
+
+
+// bclass [-h] [-n NICE] [-i CLASE[:NIVEL]] [-s normal|batch|idle] [-w on|off] [PID]...
+void run_bclass(struct execcmd * cmd)
+{
+    int opt, workers = -1;
+    struct prio_class pc = { PRIO_KEEP, PRIO_KEEP, 0, PRIO_KEEP };
+    int changed = 0;
+    char buf[128], *end;
+
+    optind = 1;
+    while ((opt = getopt(cmd->argc, cmd->argv, "hn:i:s:w:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                pc.nice = strtol(optarg, &end, 10);
+                if (*end || pc.nice < -20 || pc.nice > 19)
+                {
+                    printf("bclass: Opción -n no válida (-20-19)\n");
+                    return;
+                }
+                changed = 1;
+                break;
+            case 'i':
+                pc.ioclass = -1;
+                for (int c = 0; c < 4; c++)
+                    if (!strncmp(optarg, ioprio_names[c], strlen(ioprio_names[c])))
+                        pc.ioclass = c;
+                end = optarg + (pc.ioclass >= 0 ? strlen(ioprio_names[pc.ioclass]) : 0);
+                pc.iolevel = pc.ioclass == 1 || pc.ioclass == 2 ? 4 : 0;
+                if (pc.ioclass >= 0 && *end == ':' && (pc.ioclass == 1 || pc.ioclass == 2))
+                    pc.iolevel = strtol(end + 1, &end, 10);
+                if (pc.ioclass < 0 || *end || pc.iolevel < 0 || pc.iolevel > 7)
+                {
+                    printf("bclass: Opción -i no válida, debe ser none, idle, be[:0-7] o rt[:0-7]\n");
+                    return;
+                }
+                changed = 1;
+                break;
+            case 's':
+                if (!strcmp(optarg, "normal"))
+                    pc.policy = SCHED_OTHER;
+                else if (!strcmp(optarg, "batch"))
+                    pc.policy = SCHED_BATCH;
+                else if (!strcmp(optarg, "idle"))
+                    pc.policy = SCHED_IDLE;
+                else
+                {
+                    printf("bclass: Opción -s no válida, debe ser normal, batch o idle\n");
+                    return;
+                }
+                changed = 1;
+                break;
+            case 'w':
+                if (!strcmp(optarg, "on") || !strcmp(optarg, "off"))
+                    workers = !strcmp(optarg, "on");
+                else
+                {
+                    printf("bclass: Opción -w no válida, debe ser on u off\n");
+                    return;
+                }
+                break;
+            case 'h':
+            default:
+                printf("Uso: bclass [-h] [-n NICE] [-i CLASE[:NIVEL]] [-s normal|batch|idle] [-w on|off] [PID]...\n"
+                       "\tSin PID, fija la clase de las siguientes tareas en segundo plano\n"
+                       "\t(actual: %s);\n"
+                       "\tcon PID, cambia la de esas tareas (y de todos sus procesos)\n"
+                       "\tOpción -n: valor nice (-20-19)\n"
+                       "\tOpción -i: clase de E/S: none, idle, be[:0-7] o rt[:0-7]\n"
+                       "\tOpción -s: política de planificación\n"
+                       "\tOpción -w: aplica también la clase a los trabajadores de psplit -p\n"
+                       "\t           (actual: %s)\n",
+                       format_prio_class(&g_bg_class, buf, sizeof(buf)),
+                       g_bg_workers ? "on" : "off");
+                return;
+        }
+    }
+
+    if (workers >= 0)
+        g_bg_workers = workers;
+
+    if (optind == cmd->argc)
+    {
+        if (changed)
+        {
+            if (pc.nice != PRIO_KEEP)
+                g_bg_class.nice = pc.nice;
+            if (pc.ioclass != PRIO_KEEP)
+            {
+                g_bg_class.ioclass = pc.ioclass;
+                g_bg_class.iolevel = pc.iolevel;
+            }
+            if (pc.policy != PRIO_KEEP)
+                g_bg_class.policy = pc.policy;
+        }
+        else if (workers < 0)
+            printf("%s (psplit -p: %s)\n", format_prio_class(&g_bg_class, buf, sizeof(buf)),
+                    g_bg_workers ? "on" : "off");
+        return;
+    }
+
+    for (int i = optind; i < cmd->argc; i++)
+    {
+        pid_t pid = strtol(cmd->argv[i], &end, 10);
+        int job = -1;
+
+        for (int j = 0; j < MAX_PIDS && !*end; j++)
+            if (processes[j] != -1 && processes[j] == pid)
+                job = j;
+        if (job < 0)
+        {
+            printf("bclass: %s no es una tarea en segundo plano\n", cmd->argv[i]);
+            g_status = 1;
+            continue;
+        }
+
+        if (changed && apply_prio_class_tree(pid, &pc, 0) < 0)
+            g_status = 1;
+        else if (!changed)
+        {
+            struct prio_class cur;
+            if (get_prio_class(pid, &cur) < 0)
+            {
+                fprintf(stderr, "bclass: %d: %s\n", pid, strerror(errno));
+                g_status = 1;
+                continue;
+            }
+            printf("[%d] %s\n", pid, format_prio_class(&cur, buf, sizeof(buf)));
+        }
+    }
+}
+
+
+/******************************************************************************
+ * Órdenes internas rápidas: `echo`, `true`, `cat` y `tee`
+ ******************************************************************************/
+
+
+// Estas órdenes se ejecutan sin `fork` ni `exec` y reproducen el
+// comportamiento de coreutils para las opciones que admiten. Con cualquier
+// otra opción se ejecuta el programa externo, que también está disponible
+// siempre mediante `command` (p. ej. `command cat -n fichero`).
+
+
+// Ejecuta `cmd` como programa externo aunque tenga el nombre de una orden
+// interna
+void run_external(struct execcmd * cmd)
+{
+    pid_t pid;
+
+    if ((pid = fork_or_panic("fork external")) == 0)
+        exec_cmd(cmd);
+    set_status(wait_child(pid));
+}
+
+
+// Anota un error al escribir la salida de una orden interna. Si el lector ha
+// cerrado la tubería (EPIPE) la orden termina sin mensaje y con el estado 141,
+// como si la hubiera matado SIGPIPE.
+void output_error(const char * prefix)
+{
+    if (errno == EPIPE)
+    {
+        g_status = 128 + SIGPIPE;
+        return;
+    }
+    fprintf(stderr, "%s: %s\n", prefix, strerror(errno));
+    g_status = 1;
+}
+
+
+// Escribe `len` bytes de `buf` en `fd` reintentando las escrituras parciales
+int write_all(int fd, const char * buf, size_t len)
+{
+    ssize_t written;
+
+    while (len > 0)
+    {
+        if ((written = write(fd, buf, len)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+
+// Copia `fd_in` en `fd_out` con `read`/`write`. Devuelve -1 si falla la
+// lectura y -2 si falla la escritura.
+int copy_rw(int fd_in, int fd_out, size_t len)
+{
+    char buf[BSIZE * 64];
+    ssize_t n;
+
+    while (len > 0)
+    {
+        if ((n = read(fd_in, buf, len < sizeof(buf) ? len : sizeof(buf))) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        if (write_all(fd_out, buf, n) < 0)
+            return -2;
+        len -= n;
+    }
+    return 0;
+}
+
+
+// `copy_fd` copia todo el contenido de `fd_in` en `fd_out` sin pasar por el
+// espacio de usuario siempre que el núcleo lo permite: `sendfile` si la
+// entrada es un fichero regular y `splice` si alguno de los extremos es una
+// tubería. Devuelve lo mismo que `copy_rw`.
+int copy_fd(int fd_in, int fd_out)
+{
+    struct stat in, out;
+    ssize_t n;
+    int use_sendfile, use_splice;
+
+    if (fstat(fd_in, &in) < 0)
+        return -1;
+    if (fstat(fd_out, &out) < 0)
+        return -2;
+    use_sendfile = S_ISREG(in.st_mode);
+    use_splice = S_ISFIFO(in.st_mode) || S_ISFIFO(out.st_mode);
+
+    for (;;)
+    {
+        if (use_sendfile)
+            n = sendfile(fd_out, fd_in, NULL, 1 << 30);
+        else if (use_splice)
+            n = splice(fd_in, NULL, fd_out, NULL, 1 << 30, SPLICE_F_MOVE);
+        else
+            break;
+
+        if (n == 0)
+            return 0;
+        if (n > 0 || errno == EINTR)
+            continue;
+        if (errno != EINVAL && errno != ENOSYS)
+            return errno == EPIPE || errno == ENOSPC || errno == EDQUOT ||
+                   errno == EFBIG ? -2 : -1;
+        // El descriptor no admite la copia en el núcleo: se continúa con
+        // `read`/`write` desde la posición actual
+        use_sendfile = use_splice = 0;
+    }
+
+    return copy_rw(fd_in, fd_out, SIZE_MAX);
+}
+
+
+// echo [-neE] [STRING]...
+void run_echo(struct execcmd * cmd)
+{
+    int newline = 1, escapes = 0;
+    int i;
+
+    // Como en coreutils, solo son opciones los argumentos iniciales formados
+    // exclusivamente por `n`, `e` y `E`
+    for (i = 1; i < cmd->argc; i++)
+    {
+        char * opt = cmd->argv[i];
+        if (opt[0] != '-' || opt[1] == 0 || strspn(opt + 1, "neE") != strlen(opt + 1))
+            break;
+        for (opt++; *opt; opt++)
+        {
+            if (*opt == 'n')
+                newline = 0;
+            else
+                escapes = (*opt == 'e');
+        }
+    }
+
+    for (int first = i; i < cmd->argc; i++)
+    {
+        char * s = cmd->argv[i];
+
+        if (i > first)
+            putchar(' ');
+        if (!escapes)
+        {
+            fputs(s, stdout);
+            continue;
+        }
+
+        for (; *s; s++)
+        {
+            int c = *s, digits;
+
+            if (c != '\\' || s[1] == 0)
+            {
+                putchar(c);
+                continue;
+            }
+            switch (*++s)
+            {
+                case 'a': c = '\a'; break;
+                case 'b': c = '\b'; break;
+                case 'c':
+                    if (fflush(stdout) == EOF)
+                        output_error("echo: write error");
+                    return;
+                case 'e': c = 0x1b; break;
+                case 'f': c = '\f'; break;
+                case 'n': c = '\n'; break;
+                case 'r': c = '\r'; break;
+                case 't': c = '\t'; break;
+                case 'v': c = '\v'; break;
+                case '\\': c = '\\'; break;
+                case '0':
+                    for (c = 0, digits = 0; digits < 3 && s[1] >= '0' && s[1] <= '7'; digits++)
+                        c = c * 8 + (*++s - '0');
+                    break;
+                case 'x':
+                    if (!isxdigit((unsigned char) s[1]))
+                    {
+                        putchar('\\');
+                        c = 'x';
+                        break;
+                    }
+                    for (c = 0, digits = 0; digits < 2 && isxdigit((unsigned char) s[1]); digits++)
+                    {
+                        s++;
+                        c = c * 16 + (isdigit((unsigned char) *s) ? *s - '0'
+                                      : tolower((unsigned char) *s) - 'a' + 10);
                     }
-                    if(written == -1){
-                        perror("write");
-                        exit(EXIT_FAILURE);
+                    break;
+                default:
+                    putchar('\\');
+                    c = *s;
+                    break;
+            }
+            putchar(c);
+        }
+    }
+
+    if (newline)
+        putchar('\n');
+    if (fflush(stdout) == EOF)
+        output_error("echo: write error");
+}
+
+
+// true [ignora los argumentos]
+void run_true(struct execcmd * cmd)
+{
+}
+
+
+// Devuelve 1 si los argumentos de `cmd` contienen alguna opción distinta de
+// las de `supported`. Deja en `*first` el primer operando.
+int has_unsupported_options(struct execcmd * cmd, const char * supported, int * first)
+{
+    int i;
+
+    for (i = 1; i < cmd->argc; i++)
+    {
+        char * arg = cmd->argv[i];
+        if (!strcmp(arg, "--"))
+        {
+            i++;
+            break;
+        }
+        if (arg[0] != '-' || arg[1] == 0)
+            break;
+        if (arg[1] == '-' || strspn(arg + 1, supported) != strlen(arg + 1))
+            return 1;
+    }
+    *first = i;
+    return 0;
+}
+
+
+// cat [-u] [FILE]...
+void run_cat(struct execcmd * cmd)
+{
+    int first, fd, rc;
+
+    // `-u` no tiene efecto: la salida nunca pasa por un búfer
+    if (has_unsupported_options(cmd, "u", &first))
+    {
+        run_external(cmd);
+        return;
+    }
+
+    for (int i = first; i == first || i < cmd->argc; i++)
+    {
+        char * file = i < cmd->argc ? cmd->argv[i] : "-";
+
+        if (!strcmp(file, "-"))
+            fd = STDIN_FILENO;
+        else if ((fd = open(file, O_RDONLY)) < 0)
+        {
+            fprintf(stderr, "cat: %s: %s\n", file, strerror(errno));
+            g_status = 1;
+            continue;
+        }
+
+        if ((rc = copy_fd(fd, STDOUT_FILENO)) == -1)
+        {
+            fprintf(stderr, "cat: %s: %s\n", file, strerror(errno));
+            g_status = 1;
+        }
+        else if (rc == -2)
+            output_error("cat: write error");
+
+        if (fd != STDIN_FILENO)
+            TRY( close(fd) );
+        if (rc == -2)
+            return;
+    }
+}
+
+
+// Vacía en `fd` los `len` bytes que hay en la tubería `p`
+int drain_pipe(int p, int fd, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        if ((n = splice(p, NULL, fd, NULL, len, SPLICE_F_MOVE)) > 0)
+            len -= n;
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else if (n < 0 && errno == EINVAL)
+            return copy_rw(p, fd, len) == 0 ? 0 : -1;
+        else
+            return -1;
+    }
+    return 0;
+}
+
+
+// tee [-ai] [FILE]...
+//
+// Los datos se mueven de la entrada a una tubería intermedia con `splice`;
+// cada fichero recibe un duplicado hecho con `tee(2)` sobre otra tubería
+// vacía de la misma capacidad (que, por tanto, admite el bloque entero) y la
+// salida estándar se queda con el original. Así los datos nunca se copian al
+// espacio de usuario.
+void run_tee(struct execcmd * cmd)
+{
+    int first, append = 0;
+    int flags = O_WRONLY | O_CREAT;
+    int scratch[2], copy[2];
+    ssize_t n;
+
+    if (has_unsupported_options(cmd, "ai", &first))
+    {
+        run_external(cmd);
+        return;
+    }
+    for (int i = 1; i < first; i++)
+        if (strcmp(cmd->argv[i], "--") && strchr(cmd->argv[i], 'a'))
+            append = 1;
+    flags |= append ? O_APPEND : O_TRUNC;
+
+    int nfiles = cmd->argc - first;
+    int fds[nfiles > 0 ? nfiles : 1];
+    for (int i = 0; i < nfiles; i++)
+        if ((fds[i] = open(cmd->argv[first + i], flags, 0666)) < 0)
+        {
+            fprintf(stderr, "tee: %s: %s\n", cmd->argv[first + i], strerror(errno));
+            g_status = 1;
+        }
+
+    TRY( pipe2(scratch, O_CLOEXEC) );
+    TRY( pipe2(copy, O_CLOEXEC) );
+    fcntl(copy[1], F_SETPIPE_SZ, fcntl(scratch[1], F_GETPIPE_SZ));
+
+    for (;;)
+    {
+        n = splice(STDIN_FILENO, NULL, scratch[1], NULL, 1 << 30, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EINVAL)
+        {
+            // La entrada no admite `splice`: se lee a un búfer y se escribe
+            // en cada destino
+            char buf[BSIZE * 64];
+            while ((n = read(STDIN_FILENO, buf, sizeof(buf))) != 0)
+            {
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0)
+                    break;
+                for (int i = 0; i < nfiles; i++)
+                    if (fds[i] >= 0 && write_all(fds[i], buf, n) < 0)
+                    {
+                        fprintf(stderr, "tee: %s: %s\n", cmd->argv[first + i], strerror(errno));
+                        g_status = 1;
+                        TRY( close(fds[i]) );
+                        fds[i] = -1;
                     }
-                 }
-                 if(bytes_left == 0){
-                    bytes_left = maxBytes;
-                    TRY(fsync(fd_write));
-                    TRY( close(fd_write) );
-            	}
+                if (write_all(STDOUT_FILENO, buf, n) < 0)
+                {
+                    output_error("tee: standard output");
+                    n = 0;
+                    break;
+                }
             }
         }
-	}
-    if(fd_read!= STDIN_FILENO)
-        TRY( close(fd_read) );
+        if (n < 0)
+        {
+            fprintf(stderr, "tee: %s: %s\n", "standard input", strerror(errno));
+            g_status = 1;
+        }
+        if (n <= 0)
+            break;
+
+        for (int i = 0; i < nfiles; i++)
+        {
+            if (fds[i] < 0)
+                continue;
+            if (tee(scratch[0], copy[1], n, 0) != n || drain_pipe(copy[0], fds[i], n) < 0)
+            {
+                fprintf(stderr, "tee: %s: %s\n", cmd->argv[first + i], strerror(errno));
+                g_status = 1;
+                TRY( close(fds[i]) );
+                fds[i] = -1;
+                // Descarta lo que haya quedado en la tubería de copia
+                TRY( close(copy[0]) );
+                TRY( close(copy[1]) );
+                TRY( pipe2(copy, O_CLOEXEC) );
+                fcntl(copy[1], F_SETPIPE_SZ, fcntl(scratch[1], F_GETPIPE_SZ));
+            }
+        }
+        if (drain_pipe(scratch[0], STDOUT_FILENO, n) < 0)
+        {
+            output_error("tee: standard output");
+            break;
+        }
+    }
+
+    for (int i = 0; i < nfiles; i++)
+        if (fds[i] >= 0)
+            TRY( close(fds[i]) );
+    TRY( close(scratch[0]) );
+    TRY( close(scratch[1]) );
+    TRY( close(copy[0]) );
+    TRY( close(copy[1]) );
 }
-void run_psplit(struct execcmd * cmd){
-    int opt;
-    optind = 1;
-    int size = BSIZE;
-    int lines_per_file,bytes_per_file;
-    lines_per_file = bytes_per_file = 0;
-    int b =0;int l = 0; int p = 0; int index = 0;
-    int procs_per_file = 0;
-    
-    while ((opt = getopt(cmd->argc, cmd->argv, "hl:b:s:p:")) != -1) {
-        switch (opt) {
-            case 's':
-                size = atoi(optarg);
-                if(size < 1 || size > pow(2,20)){
-                    printf("psplit: Opción -s no válida\n");
+
+
+/******************************************************************************
+ * Memorización de órdenes: `memo`
+ ******************************************************************************/
+
+
+// `memo ORDEN` guarda la salida estándar y el estado de terminación de ORDEN
+// bajo una clave calculada a partir de sus argumentos, el directorio actual,
+// las variables de entorno indicadas con `-e` y la identidad de los ficheros
+// de entrada indicados con `-f` (dispositivo, nodo-i, tamaño y fecha de
+// modificación o, con `-H`, su contenido). Si la clave ya está en la caché,
+// la salida se reproduce con `sendfile` sin ejecutar nada.
+//
+// La caché es un directorio con dos subdirectorios:
+//
+// - `objects/HASH-TAMAÑO`: salidas, direccionadas por su contenido, de modo
+//   que órdenes distintas con la misma salida la comparten.
+// - `keys/CLAVE`: una línea "ESTADO OBJETO". Su fecha de modificación se
+//   actualiza en cada acierto y sirve de orden LRU para expulsar entradas
+//   cuando las salidas superan el tamaño máximo.
+//
+// El fichero `size` lleva la cuenta del tamaño de los objetos, de modo que un
+// fallo no tiene que recorrer la caché: solo cuando un objeto nuevo hace que
+// se supere el máximo se recorren las claves y se expulsan las más antiguas
+// hasta dejar la caché en tres cuartos del máximo.
+//
+// La salida de error no se guarda, la entrada estándar no forma parte de la
+// clave y, en un fallo, la salida se muestra cuando la orden termina.
+
+#define MEMO_DIR ".cache/simplesh/memo"
+#define MEMO_MAX_SIZE (256LL << 20)
+
+long long g_memo_max = MEMO_MAX_SIZE;
+
+
+// Añade a `*h` el contenido del descriptor `fd` desde su posición actual.
+// Devuelve el número de bytes o -1.
+long long memo_hash_fd(int fd, unsigned long long* h)
+{
+    char buf[BSIZE * 64];
+    long long total = 0;
+    ssize_t n;
+
+    while ((n = read(fd, buf, sizeof(buf))) != 0)
+    {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        *h = fnv1a64(*h, buf, n);
+        total += n;
+    }
+    return total;
+}
+
+
+// Crea `path` y los directorios intermedios que falten
+int mkdir_p(char* path)
+{
+    for (char* p = path + 1; ; p++)
+    {
+        if (*p != '/' && *p != 0)
+            continue;
+        char c = *p;
+        *p = 0;
+        int rc = mkdir(path, 0700);
+        *p = c;
+        if (rc < 0 && errno != EEXIST)
+            return -1;
+        if (c == 0)
+            return 0;
+    }
+}
+
+
+// Directorio de la caché: `SIMPLESH_MEMO_DIR` o ~/.cache/simplesh/memo
+int memo_dir(char* dir, size_t size)
+{
+    const char* env = getenv("SIMPLESH_MEMO_DIR");
+    const char* home = getenv("HOME");
+    char path[PATH_MAX + 16];
+
+    if (env && *env)
+        snprintf(dir, size, "%s", env);
+    else if (home)
+        snprintf(dir, size, "%s/%s", home, MEMO_DIR);
+    else
+    {
+        fprintf(stderr, "memo: HOME no está definida\n");
+        return -1;
+    }
+
+    for (const char* sub = "keys"; sub; sub = strcmp(sub, "keys") ? NULL : "objects")
+    {
+        snprintf(path, sizeof(path), "%s/%s", dir, sub);
+        if (mkdir_p(path) < 0)
+        {
+            fprintf(stderr, "memo: %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+// Clave de `argv` en el directorio actual con las variables `vars` y los
+// ficheros de entrada `files`
+unsigned long long memo_key(char** argv, char** vars, int nvars,
+        char** files, int nfiles, int content)
+{
+    unsigned long long h = FNV1A_INIT;
+    const char* cwd = shell_cwd();
+
+    h = fnv1a64(h, cwd, strlen(cwd) + 1);
+    for (int i = 0; argv[i]; i++)
+        h = fnv1a64(h, argv[i], strlen(argv[i]) + 1);
+
+    for (int i = 0; i < nvars; i++)
+    {
+        const char* value = getenv(vars[i]);
+        h = fnv1a64(h, "\1", 1);
+        h = fnv1a64(h, vars[i], strlen(vars[i]) + 1);
+        // Una variable sin definir no es lo mismo que una vacía
+        if (value)
+            h = fnv1a64(h, value, strlen(value) + 1);
+    }
+
+    for (int i = 0; i < nfiles; i++)
+    {
+        struct stat st;
+        int fd;
+
+        h = fnv1a64(h, "\2", 1);
+        h = fnv1a64(h, files[i], strlen(files[i]) + 1);
+        if (content && (fd = open(files[i], O_RDONLY | O_CLOEXEC)) >= 0)
+        {
+            long long len = memo_hash_fd(fd, &h);
+            h = fnv1a64(h, &len, sizeof(len));
+            TRY( close(fd) );
+        }
+        else if (!content && stat(files[i], &st) == 0)
+        {
+            long long id[] = { st.st_dev, st.st_ino, st.st_size,
+                st.st_mtim.tv_sec, st.st_mtim.tv_nsec };
+            h = fnv1a64(h, id, sizeof(id));
+        }
+        else
+            h = fnv1a64(h, "\3", 1);    // No existe o no se puede leer
+    }
+    return h;
+}
+
+
+// Reproduce la entrada `key` de la caché `dir`. Devuelve su estado de
+// terminación o -1 si no está.
+int memo_replay(const char* dir, unsigned long long key)
+{
+    char path[PATH_MAX + 64], line[128], object[64];
+    int fd, obj, status;
+    ssize_t n;
+
+    snprintf(path, sizeof(path), "%s/keys/%016llx", dir, key);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    n = read(fd, line, sizeof(line) - 1);
+    line[n > 0 ? n : 0] = 0;
+    if (sscanf(line, "%d %63s", &status, object) != 2)
+    {
+        TRY( close(fd) );
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/objects/%s", dir, object);
+    if ((obj = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+        // El objeto se ha expulsado: la clave ya no sirve
+        TRY( close(fd) );
+        return -1;
+    }
+    // La fecha de modificación de la clave es su último uso
+    futimens(fd, NULL);
+    TRY( close(fd) );
+
+    if (copy_fd(obj, STDOUT_FILENO) == -2)
+        fprintf(stderr, "memo: write error: %s\n", strerror(errno));
+    TRY( close(obj) );
+    return status;
+}
+
+
+// Suma `delta` al tamaño de los objetos de la caché `dir` (o lo fija en
+// `delta` si `set`) y devuelve el nuevo total, o -1 si aún no se conoce
+long long memo_size(const char* dir, long long delta, int set)
+{
+    char path[PATH_MAX + 16], buf[32];
+    long long total = -1;
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/size", dir);
+    if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0)
+        return -1;
+    // Varios shells pueden compartir la caché
+    TRY( flock(fd, LOCK_EX) );
+    if ((n = pread(fd, buf, sizeof(buf) - 1, 0)) > 0)
+    {
+        buf[n] = 0;
+        total = atoll(buf);
+    }
+    total = set ? delta : total < 0 ? -1 : total + delta;
+    n = snprintf(buf, sizeof(buf), "%lld\n", total);
+    if (pwrite(fd, buf, n, 0) != n || ftruncate(fd, n) < 0)
+        total = -1;
+    TRY( close(fd) );
+    return total;
+}
+
+
+// Guarda en la caché `dir` la salida del fichero temporal `tmp` (abierto en
+// `fd`) con el estado `status` bajo la clave `key`. Devuelve el tamaño del
+// objeto si es nuevo, 0 si ya existía o -1 si no se ha guardado.
+long long memo_store(const char* dir, unsigned long long key, const char* tmp, int fd, int status)
+{
+    char path[PATH_MAX + 64], object[64], line[128];
+    unsigned long long h = FNV1A_INIT;
+    long long size;
+    int kfd;
+
+    TRY( lseek(fd, 0, SEEK_SET) );
+    if ((size = memo_hash_fd(fd, &h)) < 0)
+        return -1;
+    snprintf(object, sizeof(object), "%016llx-%lld", h, size);
+
+    // Si otra orden ya produjo la misma salida se reutiliza su objeto
+    snprintf(path, sizeof(path), "%s/objects/%s", dir, object);
+    if (access(path, F_OK) == 0)
+    {
+        unlink(tmp);
+        size = 0;
+    }
+    else if (rename(tmp, path) < 0)
+    {
+        fprintf(stderr, "memo: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    // La clave se escribe aparte y se renombra para que otro shell no lea
+    // nunca una línea a medias
+    snprintf(path, sizeof(path), "%s/keys/.%016llx.%d", dir, key, getpid());
+    if ((kfd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)
+        return size;
+    int len = snprintf(line, sizeof(line), "%d %s\n", status, object);
+    int ok = write_all(kfd, line, len) == 0;
+    TRY( close(kfd) );
+    char final[PATH_MAX + 64];
+    snprintf(final, sizeof(final), "%s/keys/%016llx", dir, key);
+    if (!ok || rename(path, final) < 0)
+        unlink(path);
+    return size;
+}
+
+
+struct memo_entry {
+    char name[64];
+    long long size;             // Objetos: tamaño
+    long long used;             // Último uso (ns)
+    int refs;                   // Objetos: claves que lo usan
+    struct memo_entry* object;  // Claves: su objeto
+};
+
+
+int cmp_memo_name(const void* a, const void* b)
+{
+    return strcmp(((const struct memo_entry*) a)->name, ((const struct memo_entry*) b)->name);
+}
+
+
+int cmp_memo_used(const void* a, const void* b)
+{
+    long long x = ((const struct memo_entry*) a)->used, y = ((const struct memo_entry*) b)->used;
+    return (x > y) - (x < y);
+}
+
+
+// Lee las entradas del subdirectorio `sub` de `dir`. Devuelve cuántas hay.
+int memo_list(const char* dir, const char* sub, struct memo_entry** list)
+{
+    char path[PATH_MAX + 64];
+    DIR* d;
+    struct dirent* e;
+    struct stat st;
+    int n = 0, cap = 0;
+
+    *list = NULL;
+    snprintf(path, sizeof(path), "%s/%s", dir, sub);
+    if ((d = opendir(path)) == NULL)
+        return 0;
+    while ((e = readdir(d)) != NULL)
+    {
+        if (e->d_name[0] == '.' || strlen(e->d_name) >= sizeof((*list)->name) ||
+                fstatat(dirfd(d), e->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode))
+            continue;
+        if (n == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            if ((*list = realloc(*list, cap * sizeof(**list))) == NULL)
+            {
+                perror("memo_list: realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        struct memo_entry* m = &(*list)[n++];
+        strcpy(m->name, e->d_name);
+        m->size = st.st_size;
+        m->used = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+        m->refs = 0;
+        m->object = NULL;
+    }
+    closedir(d);
+    return n;
+}
+
+
+// Expulsa las claves usadas hace más tiempo hasta que los objetos ocupan como
+// mucho `max` bytes. Devuelve el tamaño final.
+long long memo_evict(const char* dir, long long max, int* nkeys_left)
+{
+    struct memo_entry *keys, *objects;
+    int nkeys = memo_list(dir, "keys", &keys);
+    int nobjects = memo_list(dir, "objects", &objects);
+    char path[PATH_MAX + 128], line[128];
+    long long total = 0;
+
+    qsort(objects, nobjects, sizeof(*objects), cmp_memo_name);
+    for (int i = 0; i < nkeys; i++)
+    {
+        struct memo_entry want;
+        int fd;
+        ssize_t n;
+
+        snprintf(path, sizeof(path), "%s/keys/%s", dir, keys[i].name);
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+            continue;
+        n = read(fd, line, sizeof(line) - 1);
+        TRY( close(fd) );
+        line[n > 0 ? n : 0] = 0;
+        if (sscanf(line, "%*d %63s", want.name) == 1 &&
+                (keys[i].object = bsearch(&want, objects, nobjects, sizeof(*objects), cmp_memo_name)))
+            keys[i].object->refs++;
+    }
+
+    // Los objetos sin clave (y los temporales abandonados) sobran siempre
+    for (int i = 0; i < nobjects; i++)
+    {
+        if (objects[i].refs > 0 || (!strncmp(objects[i].name, "tmp.", 4) &&
+                    time(NULL) - objects[i].used / 1000000000LL < 3600))
+            total += objects[i].size;
+        else
+        {
+            snprintf(path, sizeof(path), "%s/objects/%s", dir, objects[i].name);
+            unlink(path);
+        }
+    }
+
+    qsort(keys, nkeys, sizeof(*keys), cmp_memo_used);
+    int i;
+    for (i = 0; i < nkeys && total > max; i++)
+    {
+        snprintf(path, sizeof(path), "%s/keys/%s", dir, keys[i].name);
+        unlink(path);
+        if (keys[i].object && --keys[i].object->refs == 0)
+        {
+            snprintf(path, sizeof(path), "%s/objects/%s", dir, keys[i].object->name);
+            unlink(path);
+            total -= keys[i].object->size;
+        }
+    }
+
+    memo_size(dir, total, 1);
+    if (nkeys_left)
+        *nkeys_left = nkeys - i;
+    free(keys);
+    free(objects);
+    return total;
+}
+
+
+// Cuenta las claves de la caché `dir` y devuelve lo que ocupan sus objetos
+// (sin los temporales) sin modificar nada
+long long memo_stats(const char* dir, int* nkeys)
+{
+    struct memo_entry *keys, *objects;
+    int nobjects = memo_list(dir, "objects", &objects);
+    long long total = 0;
+
+    *nkeys = memo_list(dir, "keys", &keys);
+    for (int i = 0; i < nobjects; i++)
+        if (strncmp(objects[i].name, "tmp.", 4))
+            total += objects[i].size;
+    free(keys);
+    free(objects);
+    return total;
+}
+
+
+// memo [-h] [-v] [-H] [-e VAR]... [-f FICHERO]... [-M TAMAÑO] [-s] [-c] ORDEN [ARG]...
+void run_memo(struct execcmd * cmd)
+{
+    int opt, verbose = 0, content = 0, stats = 0, clear = 0, resize = 0;
+    char* vars[MAX_ARGS];
+    char* files[MAX_ARGS];
+    int nvars = 0, nfiles = 0;
+    char dir[PATH_MAX], tmp[PATH_MAX + 32];
+    unsigned long long key;
+    int status, fd;
+    pid_t pid;
+
+    while ((opt = getopt(options_end(cmd->argc, cmd->argv, "hvHe:f:M:sc"), cmd->argv, "hvHe:f:M:sc")) != -1)
+    {
+        switch (opt)
+        {
+            case 'v':
+                verbose = 1;
+                break;
+            case 'H':
+                content = 1;
+                break;
+            case 'e':
+                vars[nvars++] = optarg;
+                break;
+            case 'f':
+                files[nfiles++] = optarg;
+                break;
+            case 'M':
+                if ((g_memo_max = parse_size(optarg)) < 0)
+                {
+                    printf("memo: Tamaño no válido '%s'\n", optarg);
+                    g_memo_max = MEMO_MAX_SIZE;
                     return;
                 }
+                resize = 1;
                 break;
-            case 'b':
-                if(!optarg || atoi(optarg) == 0){
-                    printf("psplit: Opción -b no válida, debe de establecer un tamaño en bytes\n");
-                    return;                    
-                }else{
-                    bytes_per_file = atoi(optarg);
-                    b = 1;
-                }
+            case 's':
+                stats = 1;
                 break;
+            case 'c':
+                clear = 1;
+                break;
+            case 'h':
+            default:
+                printf("Uso: memo [-h] [-v] [-H] [-e VAR]... [-f FICHERO]... [-M TAMAÑO] [-s] [-c] ORDEN [ARG]...\n"
+                       "\tEjecuta ORDEN o, si ya se ejecutó con los mismos argumentos, directorio,\n"
+                       "\tvariables y ficheros de entrada, reproduce su salida y su estado\n"
+                       "\tOpción -e: la clave incluye el valor de la variable VAR\n"
+                       "\tOpción -f: la clave incluye la identidad de FICHERO (nodo-i, tamaño y fecha)\n"
+                       "\tOpción -H: con -f, la clave incluye el contenido de los ficheros\n"
+                       "\tOpción -M: tamaño máximo de la caché (K, M o G; actual: %lld)\n"
+                       "\tOpción -s: muestra el número de entradas y el tamaño de la caché\n"
+                       "\tOpción -c: vacía la caché\n"
+                       "\tOpción -v: indica en la salida de error si hubo acierto\n",
+                       g_memo_max);
+                return;
+        }
+        if (nvars == MAX_ARGS || nfiles == MAX_ARGS)
+        {
+            printf("memo: Demasiadas opciones -e o -f (máximo %d)\n", MAX_ARGS - 1);
+            return;
+        }
+    }
+
+    if (memo_dir(dir, sizeof(dir)) < 0)
+    {
+        g_status = 1;
+        return;
+    }
+    if (clear || stats)
+    {
+        // `-s` solo consulta: la expulsión queda para los fallos, `-M` y `-c`
+        int entries;
+        if (clear)
+            memo_evict(dir, -1, NULL);
+        else if (resize)
+            memo_evict(dir, g_memo_max, NULL);
+        if (stats)
+        {
+            long long size = memo_stats(dir, &entries);
+            printf("memo: %s: %d entradas, %lld bytes (máximo %lld)\n", dir, entries, size, g_memo_max);
+        }
+        return;
+    }
+    if (optind == cmd->argc)
+    {
+        if (!resize)
+            printf("memo: Falta la orden\n");
+        else
+            memo_evict(dir, g_memo_max, NULL);
+        return;
+    }
+
+    key = memo_key(cmd->argv + optind, vars, nvars, files, nfiles, content);
+    fflush(stdout);
+    if ((status = memo_replay(dir, key)) >= 0)
+    {
+        if (verbose)
+            fprintf(stderr, "memo: acierto %016llx\n", key);
+        g_status = status;
+        return;
+    }
+    if (verbose)
+        fprintf(stderr, "memo: fallo %016llx\n", key);
+
+    snprintf(tmp, sizeof(tmp), "%s/objects/tmp.XXXXXX", dir);
+    if ((fd = mkostemp(tmp, O_CLOEXEC)) < 0)
+    {
+        fprintf(stderr, "memo: %s: %s\n", tmp, strerror(errno));
+        g_status = 1;
+        return;
+    }
+    if ((pid = fork_or_panic("fork memo")) == 0)
+    {
+        TRY( dup2(fd, STDOUT_FILENO) );
+        exec_argv_tail(cmd, optind);
+    }
+    int wstatus = wait_child(pid);
+    set_status(wstatus);
+
+    TRY( lseek(fd, 0, SEEK_SET) );
+    if (copy_fd(fd, STDOUT_FILENO) == -2)
+        fprintf(stderr, "memo: write error: %s\n", strerror(errno));
+
+    // Una orden que muere por una señal no ha terminado su trabajo y una que
+    // no se encontró (127) no tiene nada que guardar
+    if (WIFEXITED(wstatus) && WEXITSTATUS(wstatus) != 127)
+    {
+        long long added = memo_store(dir, key, tmp, fd, g_status), total;
+        if (added > 0 && ((total = memo_size(dir, added, 0)) < 0 || total > g_memo_max))
+            memo_evict(dir, g_memo_max - g_memo_max / 4, NULL);
+    }
+    else
+        unlink(tmp);
+    TRY( close(fd) );
+}
+
+
+/******************************************************************************
+ * Medidor de caudal de las tuberías: `meter`
+ ******************************************************************************/
+
+
+// `meter` es una etapa de tubería que pasa su entrada estándar a su salida
+// estándar con `splice`, sin copiar los datos al espacio de usuario, y
+// cada intervalo escribe en la salida de error el total, el caudal y el
+// tiempo que ha esperado a que llegaran datos (lectura) y a que la etapa
+// siguiente los consumiera (escritura). Así se ve qué lado de la tubería es
+// el lento. Las transferencias no bloquean: cuando una falla con `EAGAIN`,
+// `poll` dice qué extremo falta y el tiempo de espera se le apunta a él.
+
+#define METER_CHUNK (1 << 20)
+
+struct meter {
+    const char* name;
+    unsigned long long total, last_total;
+    struct timespec start, last;
+    double read_wait, write_wait, throttled;
+    int tty;
+};
 
-            case 'l':
-                if(!optarg || atoi(optarg) == 0){
-                    printf("psplit: Opción -l no válida, debe de establecer el número de lineas\n");
-                    return;                    
-                }else{
-                    lines_per_file = atoi(optarg);
-                    l = 1;
 
+void meter_report(struct meter* m, int final)
+{
+    char total[32], rate[32];
+    double t = elapsed_since(&m->start), dt = elapsed_since(&m->last);
+
+    if (final)
+    {
+        format_bytes(rate, sizeof(rate), t > 0 ? m->total / t : 0);
+        fprintf(stderr, "%s%s: %s en %.2f s (%s/s), espera lectura %.2f s, escritura %.2f s",
+                m->tty ? "\r\033[K" : "", m->name, format_bytes(total, sizeof(total), m->total),
+                t, rate, m->read_wait, m->write_wait);
+        if (m->throttled > 0)
+            fprintf(stderr, ", limitado %.2f s", m->throttled);
+        fputc('\n', stderr);
+        return;
+    }
+    format_bytes(rate, sizeof(rate), dt > 0 ? (m->total - m->last_total) / dt : 0);
+    fprintf(stderr, "%s%s: %s %s/s lectura %.2f s escritura %.2f s%s",
+            m->tty ? "\r\033[K" : "", m->name, format_bytes(total, sizeof(total), m->total),
+            rate, m->read_wait, m->write_wait, m->tty ? "" : "\n");
+    m->last_total = m->total;
+    clock_gettime(CLOCK_MONOTONIC, &m->last);
+}
+
+
+// Espera a que se pueda leer o escribir como mucho `timeout` ms y suma el
+// tiempo al extremo que faltaba
+void meter_wait(struct meter* m, int timeout)
+{
+    struct pollfd pfd[2] = {
+        { .fd = STDIN_FILENO, .events = POLLIN },
+        { .fd = STDOUT_FILENO, .events = POLLOUT },
+    };
+    struct timespec start;
+    int reading;
+
+    // Si hay datos para leer, lo que falta es sitio para escribirlos
+    poll(pfd, 1, 0);
+    reading = pfd[0].revents == 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (poll(&pfd[reading ? 0 : 1], 1, timeout) < 0 && errno != EINTR)
+    {
+        perror("meter: poll");
+        exit(EXIT_FAILURE);
+    }
+    *(reading ? &m->read_wait : &m->write_wait) += elapsed_since(&start);
+}
+
+
+// meter [-h] [-q] [-i SEGUNDOS] [-L TASA] [-N NOMBRE]
+void run_meter(struct execcmd * cmd)
+{
+    struct meter m = { .name = "meter" };
+    struct sigaction ign = { .sa_handler = SIG_IGN }, old;
+    double interval = 1;
+    long long rate = 0;
+    int opt, quiet = 0, use_splice = 1, done = 0, err = 0;
+    char buf[BSIZE * 64];
+    ssize_t n;
+
+    while ((opt = getopt(cmd->argc, cmd->argv, "hqi:L:N:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'q':
+                quiet = 1;
+                break;
+            case 'i':
+                if ((interval = atof(optarg)) <= 0)
+                {
+                    printf("meter: Intervalo no válido '%s'\n", optarg);
+                    return;
                 }
                 break;
-            case 'p':
-                if(!optarg || atoi(optarg) == 0){
-                    printf("psplit: Opción -p no válida\n");
+            case 'L':
+                if ((rate = parse_size(optarg)) <= 0)
+                {
+                    printf("meter: Tasa no válida '%s'\n", optarg);
                     return;
-                 }else{
-                     procs_per_file = atoi(optarg);
-                     p = procs_per_file;
-                 }
+                }
                 break;
-            case 'h':
-            	printf("Uso: psplit [-l NLINES] [-b NBYTES] [-s BSIZE] [-p PROCS] [FILE1] [FILE2]...\n");
-				printf("Opciones:\n");
-				printf("-l NLINES Número máximo de líneas por fichero.\n");
-				printf("-b NBYTES Número máximo de bytes por fichero.\n");
-				printf("-s BSIZE  Tamaño en bytes de los bloques leídos de [FILEn] o stdin.\n");
-				printf("-p PROCS  Número máximo de procesos simultáneos.\n");
-				printf("-h        Ayuda\n");
-				printf("\n");
-				return;
+            case 'N':
+                m.name = optarg;
                 break;
-            default: /* ? */
-                fprintf(stderr, "Usage: %s [-l NLINES] [-b NBYTES] [-s BSIZE] [-p PROCS] [FILE1] [FILE2]...\n", cmd->argv[0]);
+            case 'h':
+            default:
+                printf("Uso: meter [-h] [-q] [-i SEGUNDOS] [-L TASA] [-N NOMBRE]\n"
+                       "\tCopia la entrada estándar en la salida estándar e informa por la salida\n"
+                       "\tde error del total, el caudal y el tiempo de espera de lectura y escritura.\n"
+                       "\t-q           Solo informa al final.\n"
+                       "\t-i SEGUNDOS  Intervalo entre informes (1 por defecto).\n"
+                       "\t-L TASA      Limita el caudal a TASA bytes por segundo (admite K, M y G).\n"
+                       "\t-N NOMBRE    Nombre con el que se identifica la etapa.\n");
                 return;
         }
     }
-    if(l && b){
-        printf("psplit: Opciones incompatibles\n");
-        exit(EXIT_FAILURE);
-    }
-    /* Si hemos parseado todo es que no hemos especificado ficheros por 
-        argumentos y debemos de coger la entrada estándar*/
-    int wstatus;
-    if(optind == cmd->argc){
-        process_option("stdin",size,l,lines_per_file,b,bytes_per_file);
-    }else{
 
-        if(p){
-            pid_t pid[procs_per_file];
-            memset(pid,-1,procs_per_file * sizeof(pid[0]));
-            for(int i = optind; i < cmd->argc; i++){
-                if(pid[index % procs_per_file] != -1){ //cola circular
-                    TRY(waitpid(pid[(index)%procs_per_file],&wstatus,WUNTRACED | WCONTINUED)); // Para reportar estatus de hijos parados y continuados
-                }
+    m.tty = isatty(STDERR_FILENO);
+    clock_gettime(CLOCK_MONOTONIC, &m.start);
+    m.last = m.start;
+    // Si la etapa siguiente termina, se informa igualmente
+    TRY( sigaction(SIGPIPE, &ign, &old) );
 
-                if ((pid[(index++) % procs_per_file] = fork_or_panic("fork psplit")) == 0){
-                    process_option(cmd->argv[i],size,l,lines_per_file,b,bytes_per_file); // Codigo del hijo
-                    exit(EXIT_SUCCESS);
-                }
-            }
-            
-           
-            for(int j = 0 ; j < procs_per_file; j++){
-                if(pid[j]!= -1){
-                    TRY(waitpid(pid[j],&wstatus,WUNTRACED|WCONTINUED));
-                }
-            }
-            
-        }else {
-            for(int i = optind; i < cmd->argc; i++){
-                process_option(cmd->argv[i],size,l,lines_per_file,b,bytes_per_file);
+    while (!done)
+    {
+        size_t len = sizeof(buf);
+        double t = elapsed_since(&m.start);
+
+        if (!quiet && elapsed_since(&m.last) >= interval)
+            meter_report(&m, 0);
+
+        // Con `-L` se mueven bloques de una vigésima de segundo y se espera
+        // a que el total vuelva a corresponder a la tasa
+        if (use_splice)
+            len = METER_CHUNK;
+        if (rate)
+        {
+            double ahead = (double) m.total / rate - t;
+            if (ahead > 0)
+            {
+                struct timespec ts = { (time_t) ahead, (long) ((ahead - (time_t) ahead) * 1e9) };
+                while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+                    ;
+                m.throttled += ahead;
+                continue;
             }
+            if ((long long) len > rate / 20 + 1)
+                len = rate / 20 + 1;
         }
-        
+
+        if (use_splice)
+        {
+            n = splice(STDIN_FILENO, NULL, STDOUT_FILENO, NULL, len,
+                       SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+            if (n > 0)
+                m.total += n;
+            else if (n == 0)
+                done = 1;
+            else if (errno == EAGAIN)
+                meter_wait(&m, quiet ? -1 : (int) (interval * 1000) + 1);
+            else if (errno == EINVAL)
+                use_splice = 0;     // Ningún extremo es una tubería
+            else if (errno != EINTR)
+                done = -1;
+            continue;
+        }
+
+        // Sin `splice`, lo que tarda cada llamada es la espera de su lado
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        n = read(STDIN_FILENO, buf, len);
+        m.read_wait += elapsed_since(&start);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            done = n == 0 ? 1 : -1;
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (write_all(STDOUT_FILENO, buf, n) < 0)
+            done = -1;
+        m.write_wait += elapsed_since(&start);
+        m.total += n;
     }
-    optind = 1;
+
+    // La etapa siguiente puede cerrar su entrada antes del final: no es un
+    // error de `meter`
+    if (done < 0 && (err = errno) != EPIPE)
+        fprintf(stderr, "%s: %s\n", m.name, strerror(err));
+    meter_report(&m, 1);
+    TRY( sigaction(SIGPIPE, &old, NULL) );
+    g_status = done < 0 && err != EPIPE;
 }
 
 
-void run_bjobs(struct execcmd * cmd){
+/******************************************************************************
+ * Límite de tiempo de las órdenes: `timeout`
+ ******************************************************************************/
 
 
-    int opt;
-    optind = 0;  // bug libreria getopt()
-    int k,h;
-    k=0;h=0;
-    int i = 0;
-    while ((opt = getopt(cmd->argc, cmd->argv, "hk")) != -1) {
-        switch (opt) {
-            case 'h':
-                h=1;
+// `timeout DURACIÓN ORDEN` ejecuta ORDEN en su propio grupo de procesos y
+// espera con `poll` a un `pidfd` del hijo y a un `timerfd`, sin proceso
+// intermedio. Si vence el plazo, envía la señal de `-s` (SIGTERM por
+// defecto) a todo el grupo y, con `-k`, SIGKILL si sigue vivo pasado ese
+// tiempo de gracia. El `signalfd` de SIGCHLD también se vigila: las tareas
+// en segundo plano que terminen entretanto se recogen como siempre, y sirve
+// para saber cuándo termina el hijo si el núcleo no tiene `pidfd_open`.
+
+// Señales que `timeout -s` admite por su nombre (con o sin `SIG`)
+static const struct { const char* name; int sig; } g_signal_names[] = {
+    { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT },
+    { "KILL", SIGKILL }, { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 },
+    { "ALRM", SIGALRM }, { "TERM", SIGTERM }, { "CONT", SIGCONT },
+    { "STOP", SIGSTOP },
+};
+
+
+// Devuelve el número de la señal `s` (nombre o número) o -1
+int parse_signal(const char* s)
+{
+    char* end;
+    long sig = strtol(s, &end, 10);
+
+    if (end != s && *end == 0)
+        return sig > 0 && sig < NSIG ? sig : -1;
+    if (!strncasecmp(s, "SIG", 3))
+        s += 3;
+    for (size_t i = 0; i < sizeof(g_signal_names) / sizeof(g_signal_names[0]); i++)
+        if (!strcasecmp(s, g_signal_names[i].name))
+            return g_signal_names[i].sig;
+    return -1;
+}
+
+
+// Devuelve en segundos una duración con sufijo `s`, `m`, `h` o `d` opcional,
+// o -1 si no es válida
+double parse_duration(const char* s)
+{
+    char* end;
+    double t = strtod(s, &end);
+
+    if (end == s || t < 0)
+        return -1;
+    switch (*end)
+    {
+        case 0: case 's': break;
+        case 'm': t *= 60; break;
+        case 'h': t *= 3600; break;
+        case 'd': t *= 86400; break;
+        default: return -1;
+    }
+    return *end && end[1] ? -1 : t;
+}
+
+
+void arm_timer(int tfd, double seconds)
+{
+    struct itimerspec its = { 0 };
+
+    its.it_value.tv_sec = (time_t) seconds;
+    its.it_value.tv_nsec = (long) ((seconds - (time_t) seconds) * 1e9);
+    // Un plazo de 0 desactivaría el temporizador
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+        its.it_value.tv_nsec = 1;
+    TRY( timerfd_settime(tfd, 0, &its, NULL) );
+}
+
+
+// timeout [-h] [-v] [-f] [-s SEÑAL] [-k DURACIÓN] DURACIÓN ORDEN [ARG]...
+void run_timeout(struct execcmd * cmd)
+{
+    int opt, verbose = 0, foreground = 0, sig = SIGTERM;
+    int status, pidfd, tfd, sent = 0;
+    double limit, kill_after = 0;
+    struct timespec start;
+    pid_t pid;
+
+    while ((opt = getopt(options_end(cmd->argc, cmd->argv, "hvfs:k:"), cmd->argv, "hvfs:k:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'v':
+                verbose = 1;
+                break;
+            case 'f':
+                foreground = 1;
+                break;
+            case 's':
+                if ((sig = parse_signal(optarg)) < 0)
+                {
+                    printf("timeout: Señal no válida '%s'\n", optarg);
+                    return;
+                }
                 break;
             case 'k':
-                k=1;
+                if ((kill_after = parse_duration(optarg)) < 0)
+                {
+                    printf("timeout: Duración no válida '%s'\n", optarg);
+                    return;
+                }
                 break;
+            case 'h':
             default:
+                printf("Uso: timeout [-h] [-v] [-f] [-s SEÑAL] [-k DURACIÓN] DURACIÓN ORDEN [ARG]...\n"
+                       "\tEjecuta ORDEN y, si sigue en marcha pasada DURACIÓN (en segundos o con\n"
+                       "\tsufijo s, m, h o d; 0 sin límite), envía SEÑAL a su grupo de procesos.\n"
+                       "\tDevuelve 124 si se agota el plazo.\n"
+                       "\t-s SEÑAL     Señal que se envía (TERM por defecto).\n"
+                       "\t-k DURACIÓN  Envía también SIGKILL si la orden sigue viva pasado este tiempo.\n"
+                       "\t-f           No crea un grupo de procesos nuevo, de modo que la orden puede\n"
+                       "\t             leer del terminal; la señal solo llega a la orden.\n"
+                       "\t-v           Informa siempre del tiempo transcurrido.\n");
                 return;
         }
     }
-    
-    // Aqui enviar procesos en segundo plano activos
-    if(!k && !h){
-        for(int i = 0;i<MAX_PIDS;i++){
-            if(processes[i] != -1){
-                printf("[%d]\n",processes[i]);
-            }
-        }
-
-    }else if (k){
+    if (optind + 1 >= cmd->argc || (limit = parse_duration(cmd->argv[optind])) < 0)
+    {
+        printf(optind + 1 >= cmd->argc ? "timeout: Falta la orden\n"
+               : "timeout: Duración no válida '%s'\n", cmd->argv[optind]);
+        g_status = 125;
+        return;
+    }
 
-         for(int i = 0;i<MAX_PIDS;i++){
-            if(processes[i]!= -1){
-                TRY(kill(processes[i],SIGTERM));
-            }
+    loop_init();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((pid = fork_or_panic("fork timeout")) == 0)
+    {
+        if (!foreground)
+            TRY( setpgid(0, 0) );
+        exec_argv_tail(cmd, optind + 1);
+    }
+    // También en el padre, por si la señal llega antes de que el hijo lo haga
+    if (!foreground)
+        setpgid(pid, pid);
+
+    pidfd = syscall(SYS_pidfd_open, pid, 0);
+    TRY( tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC) );
+    if (limit > 0)
+        arm_timer(tfd, limit);
+
+    struct pollfd pfd[3] = {
+        { .fd = tfd, .events = POLLIN },
+        { .fd = g_sigfd, .events = POLLIN },
+        { .fd = pidfd, .events = POLLIN },    // Se ignora si es -1
+    };
+    for (;;)
+    {
+        reap_children();
+        if (take_reaped(pid, &status))
+            break;
+        if (poll(pfd, 3, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("timeout: poll");
+            exit(EXIT_FAILURE);
+        }
+        if (pfd[0].revents & POLLIN)
+        {
+            uint64_t expirations;
+            TRY( read(tfd, &expirations, sizeof(expirations)) );
+
+            // El primer vencimiento envía la señal y el segundo, SIGKILL
+            int s = sent++ ? SIGKILL : sig;
+            kill(foreground ? pid : -pid, s);
+            if (verbose)
+                fprintf(stderr, "timeout: enviada SIG%s a '%s' tras %.2f s\n",
+                        sigabbrev_np(s), cmd->argv[optind + 1], elapsed_since(&start));
+            if (sent == 1 && kill_after > 0 && s != SIGKILL)
+                arm_timer(tfd, kill_after);
         }
-    }else{
-        printf("Uso : bjobs [ -k] [-h]\n");
-        printf("      Opciones :\n");
-        printf("      -k Mata todos los procesos en segundo plano.\n");
-        printf("      -h Ayuda\n");
     }
+    if (pidfd >= 0)
+        TRY( close(pidfd) );
+    TRY( close(tfd) );
+
+    set_status(status);
+    if (sent)
+    {
+        // Como en coreutils: 124, salvo que haya hecho falta SIGKILL
+        if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGKILL)
+            g_status = 124;
+        fprintf(stderr, "timeout: '%s' superó %.2f s y terminó a los %.2f s\n",
+                cmd->argv[optind + 1], limit, elapsed_since(&start));
+    }
+    else if (verbose)
+        fprintf(stderr, "timeout: '%s' terminó a los %.2f s\n",
+                cmd->argv[optind + 1], elapsed_since(&start));
+}
+
+
+/******************************************************************************
+ * Bucle principal de `simplesh`
+ ******************************************************************************/
+
+
+/******************************************************************************
+ * Perfil del arranque
+ ******************************************************************************/
+
+
+// `simplesh -T` muestra por la salida de error cuánto tarda cada fase del
+// arranque hasta que el shell está listo para leer la primera orden. Las
+// marcas se toman siempre (es una lectura del reloj del vDSO) y solo se
+// muestran con `-T`.
+
+#define MAX_STARTUP_MARKS 16
+
+int g_profile_startup = 0;
+int g_startup_done = 0;
+struct timespec g_startup_t0;
+
+struct startup_mark {
+    const char* phase;
+    struct timespec ts;
+};
+struct startup_mark startup_marks[MAX_STARTUP_MARKS];
+int num_startup_marks = 0;
+
+
+void startup_mark(const char* phase)
+{
+    if (g_startup_done || num_startup_marks == MAX_STARTUP_MARKS)
+        return;
+    startup_marks[num_startup_marks].phase = phase;
+    clock_gettime(CLOCK_MONOTONIC, &startup_marks[num_startup_marks].ts);
+    num_startup_marks++;
+}
+
+
+double ts_diff_ms(struct timespec* a, struct timespec* b)
+{
+    return (b->tv_sec - a->tv_sec) * 1e3 + (b->tv_nsec - a->tv_nsec) / 1e6;
+}
 
-    
-    optind = 0;
 
+// Tiempo desde que el núcleo creó el proceso hasta `main` (con la
+// resolución de los *ticks* de /proc/self/stat); -1 si no se conoce
+double startup_pre_main_ms()
+{
+    char buf[BSIZE];
+    unsigned long long start;
+    struct timespec boot;
+    ssize_t n;
+    int fd;
+
+    if ((fd = open("/proc/self/stat", O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    n = read(fd, buf, sizeof(buf) - 1);
+    TRY( close(fd) );
+    if (n <= 0)
+        return -1;
+    buf[n] = 0;
+
+    // El campo 22 (`starttime`) está 20 campos después del nombre
+    char* p = strrchr(buf, ')');
+    for (int field = 2; p && field < 22; field++)
+        p = strchr(p + 1, ' ');
+    if (!p || sscanf(p, "%llu", &start) != 1)
+        return -1;
+
+    clock_gettime(CLOCK_BOOTTIME, &boot);
+    struct timespec t0 = { start / sysconf(_SC_CLK_TCK),
+        (start % sysconf(_SC_CLK_TCK)) * (1000000000L / sysconf(_SC_CLK_TCK)) };
+    double since_boot = ts_diff_ms(&t0, &boot);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return since_boot - ts_diff_ms(&g_startup_t0, &now);
+}
 
 
+// `startup_report` cierra el perfil y, con `-T`, lo muestra
+void startup_report()
+{
+    struct timespec* prev = &g_startup_t0;
+    double pre;
+
+    if (g_startup_done)
+        return;
+    startup_mark("listo");
+    g_startup_done = 1;
+    if (!g_profile_startup)
+        return;
+
+    fprintf(stderr, "arranque de simplesh (ms):\n");
+    if ((pre = startup_pre_main_ms()) >= 0)
+        fprintf(stderr, "  %-20s %9.3f (aprox.)\n", "antes de main", pre);
+    for (int i = 0; i < num_startup_marks; i++)
+    {
+        fprintf(stderr, "  %-20s %9.3f\n", startup_marks[i].phase,
+                ts_diff_ms(prev, &startup_marks[i].ts));
+        prev = &startup_marks[i].ts;
+    }
+    fprintf(stderr, "  %-20s %9.3f\n", "total desde main",
+            ts_diff_ms(&g_startup_t0, prev));
 }
 
+
 /******************************************************************************
- * Bucle principal de `simplesh`
+ * Banco de pruebas de la ejecución de órdenes
  ******************************************************************************/
 
 
+// `simplesh -B N` ejecuta N veces cada una de las formas básicas de
+// `run_cmd` sobre /bin/true y muestra la latencia (percentiles 50, 99 y
+// 99.9) y los procesos creados por orden, para comparar cambios en la forma
+// de crear y esperar procesos. Las tareas en segundo plano se miden hasta
+// que se recogen.
+
+#define BENCH_WARMUP 50
+
+struct bench_shape {
+    const char* name;
+    const char* line;
+};
+
+static const struct bench_shape bench_shapes[] = {
+    { "EXEC",  "/bin/true" },
+    { "PIPE2", "/bin/true | /bin/true" },
+    { "PIPE4", "/bin/true | /bin/true | /bin/true | /bin/true" },
+    { "REDR",  "/bin/true > /dev/null" },
+    { "SUBS",  "( /bin/true )" },
+    { "BACK",  "/bin/true &" },
+};
+
+
+int cmp_double(const void* a, const void* b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+
+void run_bench(int iters)
+{
+    double* lat;
+    struct timespec start;
+
+    if ((g_fork_count = mmap(NULL, sizeof(*g_fork_count), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+    {
+        perror("run_bench: mmap");
+        exit(EXIT_FAILURE);
+    }
+    if ((lat = malloc(iters * sizeof(double))) == NULL)
+    {
+        perror("run_bench: malloc");
+        exit(EXIT_FAILURE);
+    }
+    loop_init();
+
+    printf("%-6s %10s %10s %10s %10s\n", "forma", "p50 (us)", "p99 (us)", "p999 (us)", "procesos");
+    for (size_t s = 0; s < sizeof(bench_shapes) / sizeof(bench_shapes[0]); s++)
+    {
+        char* buf = strdup(bench_shapes[s].line);
+        struct cmd* cmd = parse_cmd(buf);
+        unsigned long forks;
+
+        null_terminate(cmd);
+        for (int i = -BENCH_WARMUP; i < iters; i++)
+        {
+            if (i == 0)
+                *g_fork_count = 0;
+            TRY( clock_gettime(CLOCK_MONOTONIC, &start) );
+            run_cmd(cmd);
+            while (jobs_running() > 0)
+                wait_event(0);
+            if (i >= 0)
+                lat[i] = elapsed_since(&start) * 1e6;
+        }
+        forks = *g_fork_count;
+
+        qsort(lat, iters, sizeof(double), cmp_double);
+        printf("%-6s %10.1f %10.1f %10.1f %10.2f\n", bench_shapes[s].name,
+                lat[iters / 2], lat[(long) iters * 99 / 100],
+                lat[(long) iters * 999 / 1000], (double) forks / iters);
+        fflush(stdout);
+
+        free_cmd(cmd);
+        free(cmd);
+        free(buf);
+    }
+
+    free(lat);
+}
+
+
 void help(char **argv)
 {
-    info("Usage: %s [-d N] [-h]\n\
+    info("Usage: %s [-d N] [-j N] [-B N] [-T] [-h]\n\
          shell simplesh v%s\n\
          Options: \n\
          -d set debug level to N\n\
+         -j run at most N background jobs at once\n\
+         -B run each command shape N times and report its latency\n\
+         -T print a breakdown of the startup time\n\
          -h help\n\n",
          argv[0], VERSION);
 }
@@ -1599,11 +8120,24 @@ void parse_args(int argc, char** argv)
     int option;
 
     // Bucle de procesamiento de parámetros
-    while((option = getopt(argc, argv, "d:h")) != -1) {
+    while((option = getopt(argc, argv, "d:j:B:Th")) != -1) {
         switch(option) {
             case 'd':
                 g_dbg_level = atoi(optarg);
                 break;
+            case 'j':
+                g_max_jobs = atoi(optarg);
+                if (g_max_jobs < 1 || g_max_jobs > MAX_PIDS)
+                    panic("-j: must be between 1 and %d\n", MAX_PIDS);
+                break;
+            case 'T':
+                g_profile_startup = 1;
+                break;
+            case 'B':
+                g_bench = atoi(optarg);
+                if (g_bench < 1)
+                    panic("-B: must be at least 1\n");
+                break;
             case 'h':
             default:
                 help(argv);
@@ -1614,19 +8148,12 @@ void parse_args(int argc, char** argv)
 }
 
 
+// El banco de pruebas del analizador (bench/parser.c) incluye este fichero
+// con su propia función `main`
+#ifndef SIMPLESH_NO_MAIN
 int main(int argc, char** argv)
 {
-    struct sigaction sa;
-    sa.sa_handler = &handle_sigchld;
-    TRY(sigemptyset(&sa.sa_mask));
-    TRY(sigaddset(&sa.sa_mask,SIGCHLD));
-    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-    if (sigaction(SIGCHLD, &sa, 0) == -1) {
-        perror(0);
-        exit(EXIT_FAILURE);
-    }
-    
-
+    clock_gettime(CLOCK_MONOTONIC, &g_startup_t0);
 
     /* Ignore signal SIGQUIT (CTRL-ALTGR-\) */
     struct sigaction s;
@@ -1639,26 +8166,53 @@ int main(int argc, char** argv)
     }
     
 
-    /* Block signal SIGINT (CTRL-C) */
+    /* Block signal SIGINT (CTRL-C) and SIGCHLD (read through a signalfd) */
     sigset_t blocked_signals;
     TRY(sigemptyset(&blocked_signals));
     TRY(sigaddset(&blocked_signals, SIGINT));
+    TRY(sigaddset(&blocked_signals, SIGCHLD));
+    TRY(sigemptyset(&g_sigchld_mask));
+    TRY(sigaddset(&g_sigchld_mask, SIGCHLD));
     if (sigprocmask(SIG_BLOCK, &blocked_signals, NULL) == -1) {
         perror("sigprocmask");
         exit(EXIT_FAILURE);
     }
+    startup_mark("sigprocmask");
 
     char* buf;
     struct cmd* cmd;
     memset(processes,-1,MAX_PIDS * sizeof(processes[0]));
     parse_args(argc, argv);
+    g_interactive = isatty(STDIN_FILENO);
+    startup_mark("argumentos");
+
+    // Por defecto, tantas tareas simultáneas como CPUs en línea
+    g_shell_pid = getpid();
+    if (!g_max_jobs)
+    {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        g_max_jobs = ncpus < 1 ? 1 : ncpus > MAX_PIDS ? MAX_PIDS : ncpus;
+    }
+    startup_mark("tareas");
+
+    if (g_bench)
+    {
+        run_bench(g_bench);
+        return 0;
+    }
 
     DPRINTF(DBG_TRACE, "STR\n");
 	 // Eliminamos la variable de entorno OLDPWD    
     TRY(unsetenv("OLDPWD"));
+    loop_init();
+    startup_mark("bucle de eventos");
     // Bucle de lectura y ejecución de órdenes
     while ((buf = get_cmd()) != NULL)
     {
+        // El análisis sintáctico modifica la línea: el historial guarda una
+        // copia. Como con `add_history`, solo se guardan las líneas
+        // tecleadas en un terminal, no las de guiones o tuberías.
+        char* line = g_interactive ? strdup(buf) : NULL;
 
         // Realiza el análisis sintáctico de la línea de órdenes
         cmd = parse_cmd(buf);
@@ -1666,14 +8220,35 @@ int main(int argc, char** argv)
         // Termina en `NULL` todas las cadenas de las estructuras `cmd`
         null_terminate(cmd);
 
+        // Una línea con errores sintácticos no se ejecuta (`$?` pasa a ser 2,
+        // como en bash)
+        if (g_parse_error)
+        {
+            g_status = 2;
+            free(line);
+            free_cmd(cmd);
+            free(cmd);
+            free(buf);
+            continue;
+        }
+
+        // Lee el contenido de los here-documents
+        read_heredocs(cmd);
+
         DBLOCK(DBG_CMD, {
             info("%s:%d:%s: print_cmd: ",
                  __FILE__, __LINE__, __func__);
             print_cmd(cmd); printf("\n"); fflush(NULL); } );
 
-        // Ejecuta la línea de órdenes
-        
-        run_cmd(cmd,&sa);
+        // Ejecuta la línea de órdenes y la guarda en el historial con su
+        // estado de terminación y su duración
+        struct timespec start;
+        time_t started = time(NULL);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        run_cmd(cmd);
+        if (line)
+            hist_append(line, started, g_status, elapsed_since(&start));
+        free(line);
 
         // Libera la memoria de las estructuras `cmd`
         free_cmd(cmd);
@@ -1685,9 +8260,11 @@ int main(int argc, char** argv)
         
         
     }
+    discard_jobs();
     
 
     DPRINTF(DBG_TRACE, "END\n");
 
     return 0;
 }
+#endif